@@ -169,6 +169,35 @@ int anetSetSendBuffer(char *err, int fd, int buffsize)
     return ANET_OK;
 }
 
+int anetSetRecvBuffer(char *err, int fd, int buffsize)
+{
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffsize, sizeof(buffsize)) == -1)
+    {
+        anetSetError(err, "setsockopt SO_RCVBUF: %s", strerror(errno));
+        return ANET_ERR;
+    }
+    return ANET_OK;
+}
+
+/* Limit the unsent bytes kept in the socket send buffer, so that data
+ * waits in user space where it can still be coalesced or dropped. */
+int anetSetNotSentLowat(char *err, int fd, int bytes)
+{
+#ifdef TCP_NOTSENT_LOWAT
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &bytes, sizeof(bytes)) == -1)
+    {
+        anetSetError(err, "setsockopt TCP_NOTSENT_LOWAT: %s", strerror(errno));
+        return ANET_ERR;
+    }
+    return ANET_OK;
+#else
+    ((void) fd);
+    ((void) bytes);
+    anetSetError(err, "TCP_NOTSENT_LOWAT not supported");
+    return ANET_ERR;
+#endif
+}
+
 int anetTcpKeepAlive(char *err, int fd)
 {
     int yes = 1;
@@ -69,6 +69,9 @@ int anetBlock(char *err, int fd);
 int anetEnableTcpNoDelay(char *err, int fd);
 int anetDisableTcpNoDelay(char *err, int fd);
 int anetTcpKeepAlive(char *err, int fd);
+int anetSetSendBuffer(char *err, int fd, int buffsize);
+int anetSetRecvBuffer(char *err, int fd, int buffsize);
+int anetSetNotSentLowat(char *err, int fd, int bytes);
 int anetSendTimeout(char *err, int fd, long long ms);
 int anetPeerToString(int fd, char *ip, size_t ip_len, int *port);
 int anetKeepAlive(char *err, int fd, int interval);
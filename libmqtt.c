@@ -22,8 +22,10 @@
  * SOFTWARE.
  */
 
+#include "lib/fmacros.h"
 #include "libmqtt.h"
 
+#define MQTT_ROLE_CLIENT
 #define MQTT_IMPLEMENTATION
 #include "mqtt.h"
 
@@ -37,10 +39,37 @@
 #include <errno.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+
+#ifdef HAVE_OPENSSL
+# include <openssl/ssl.h>
+# include <openssl/err.h>
+# include <openssl/x509v3.h>
+#endif
+
+#if defined(__linux__) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+# include <netinet/in.h>
+# include <linux/errqueue.h>
+# define LIBMQTT_ZEROCOPY
+#endif
 
 #define LIBMQTT_READ_BUFF   4096
+#define LIBMQTT_READ_MAX    (256*1024)
+#define LIBMQTT_READ_BUDGET 16
+#define LIBMQTT_READ_SHRINK 16
 #define LIBMQTT_LOG_BUFF    4096
+#define LIBMQTT_BATCH_BUFF  65536
+#define LIBMQTT_RING_BUFF   4096
+#define LIBMQTT_BUSY_POLL   50
+#define LIBMQTT_LAT_BUCKETS 512
+#define LIBMQTT_TLS_RECORD  16384
+#define LIBMQTT_PUB_SLOTS   64
+#define LIBMQTT_PUB_MAX     (2*65536)
 
 enum libmqtt_state {
     LIBMQTT_ST_SEND_PUBLUSH,
@@ -59,6 +88,24 @@ enum libmqtt_dir {
     LIBMQTT_DIR_OUT,
 };
 
+/* payload the kernel still reads from after a MSG_ZEROCOPY send. */
+struct libmqtt_zc {
+    uint32_t seq;
+    char *buf;
+    struct libmqtt_pub *pub;
+
+    struct libmqtt_zc *next;
+};
+
+/* a closed socket kept open until the kernel releases its zerocopy sends. */
+struct libmqtt_linger {
+    int fd;
+    struct libmqtt_zc *head;
+    struct libmqtt_zc *tail;
+
+    struct libmqtt_linger *next;
+};
+
 struct libmqtt_pub {
     struct {
         uint16_t packet_id;
@@ -71,8 +118,20 @@ struct libmqtt_pub {
     enum libmqtt_state s;
     enum libmqtt_dir d;
     int t;
+    int delivered;
+    struct libmqtt_zc *zc;
 
+    struct libmqtt_pub *prev;
     struct libmqtt_pub *next;
+    struct libmqtt_pub *hnext;
+};
+
+struct libmqtt_topic {
+    struct mqtt_p_template t;
+    struct mqtt_b topic;
+    int retain;
+
+    struct libmqtt_topic *next;
 };
 
 struct libmqtt {
@@ -80,17 +139,118 @@ struct libmqtt {
     struct mqtt_parser p;
     uint16_t packet_id;
 
+    struct {
+        char *s;
+        int size;
+    } out;
+
+    struct {
+        int on;
+        int cork;
+        struct mqtt_batch b;
+    } batch;
+
+    /* read buffer, sized between LIBMQTT_READ_BUFF and max by throughput. */
+    struct {
+        char *s;
+        int size;
+        int max;
+        int idle;
+    } rd;
+
+    /* bytes the socket did not accept yet, drained on AE_WRITABLE. */
+    struct {
+        char *s;
+        int size;
+        int head;
+        int n;
+        int low;
+        int high;
+        int blocked;
+        int shutdown;
+    } wq;
+
+    /* non-blocking connect in progress, completed on AE_WRITABLE. */
+    struct {
+        int on;
+        int timeout;
+        long long id;
+    } conn;
+
+    /* applied to every new socket. */
+    struct libmqtt_sockopt so;
+
+#ifdef HAVE_OPENSSL
+    /* tls transport, the last session ticket resumes the next connect. */
+    struct {
+        SSL_CTX *ctx;
+        SSL *ssl;
+        SSL_SESSION *sess;
+        char buf[LIBMQTT_TLS_RECORD];
+    } tls;
+#endif
+
+    /* MSG_ZEROCOPY sends the kernel has not released yet. */
+    struct {
+        int threshold;
+        int on;
+        uint32_t seq;
+        struct libmqtt_zc *head;
+        struct libmqtt_zc *tail;
+        struct libmqtt_linger *linger;
+        struct libmqtt_linger *spare;
+    } zc;
+
+    /* spin instead of sleeping in the poller, optionally pinned to a cpu. */
+    struct {
+        int on;
+        int cpu;
+    } spin;
+
+    /* poll wake to callback latency in ns, 8 buckets per power of two. */
+    struct {
+        long long wake;
+        uint32_t count;
+        uint32_t hist[LIBMQTT_LAT_BUCKETS];
+    } lat;
+
+    /* reconnect backoff in milliseconds, with decorrelated jitter. */
+    struct {
+        int base;
+        int max;
+        int delay;
+        int attempt;
+        int up;
+        long long id;
+        long long lost;
+        uint32_t seed;
+    } reconn;
+
+    /* resolved broker address, reused until the ttl runs out. */
+    struct {
+        char ip[INET6_ADDRSTRLEN];
+        int ttl;
+        time_t expire;
+    } dns;
+
     struct {
         int now;
         int ping;
         int send;
     } t;
 
+    /* in flight publishes, listed in retry order and hashed by direction
+     * and packet id so acks are found in constant time. */
     struct {
         struct libmqtt_pub *head;
         struct libmqtt_pub *tail;
+        struct libmqtt_pub **slot;
+        int size;
+        int count;
     } pub;
 
+    struct libmqtt_topic *topics;
+
     void *ud;
     struct libmqtt_cb cb;
 
@@ -100,246 +260,1367 @@ struct libmqtt {
     aeEventLoop *el;
     char *host;
     int port;
+    int local;
     int fd;
+    int disconnect;
     long long id;
 };
 
 static int __connect(struct libmqtt *mqtt);
+static int __send_connect(struct libmqtt *mqtt);
+static void __close(struct libmqtt *mqtt);
+static void __lost(struct libmqtt *mqtt);
+static void __delete_pub(struct libmqtt *mqtt, struct libmqtt_pub *pub);
 
 static int
-__write(struct libmqtt *mqtt, const char *data, int size) {
-    if (-1 == write(mqtt->fd, data, size)) {
+__wq_reserve(struct libmqtt *mqtt, int n) {
+    char *s;
+    int size, first;
+
+    if (mqtt->wq.n + n <= mqtt->wq.size) {
+        return 0;
+    }
+    size = mqtt->wq.size ? mqtt->wq.size : LIBMQTT_RING_BUFF;
+    while (size < mqtt->wq.n + n) {
+        size *= 2;
+    }
+    s = malloc(size);
+    if (!s) {
+        return -1;
+    }
+    if (mqtt->wq.n > 0) {
+        first = mqtt->wq.size - mqtt->wq.head;
+        if (first > mqtt->wq.n) {
+            first = mqtt->wq.n;
+        }
+        memcpy(s, mqtt->wq.s + mqtt->wq.head, first);
+        memcpy(s + first, mqtt->wq.s, mqtt->wq.n - first);
+    }
+    free(mqtt->wq.s);
+    mqtt->wq.s = s;
+    mqtt->wq.size = size;
+    mqtt->wq.head = 0;
+    return 0;
+}
+
+static int
+__wq_push(struct libmqtt *mqtt, const char *data, int n) {
+    int tail, first;
+
+    if (__wq_reserve(mqtt, n)) {
+        return -1;
+    }
+    tail = (mqtt->wq.head + mqtt->wq.n) & (mqtt->wq.size - 1);
+    first = mqtt->wq.size - tail;
+    if (first > n) {
+        first = n;
+    }
+    memcpy(mqtt->wq.s + tail, data, first);
+    memcpy(mqtt->wq.s, data + first, n - first);
+    mqtt->wq.n += n;
+    return 0;
+}
+
+static void
+__wq_drop(struct libmqtt *mqtt, int n) {
+    mqtt->wq.head = (mqtt->wq.head + n) & (mqtt->wq.size - 1);
+    mqtt->wq.n -= n;
+    if (mqtt->wq.n == 0) {
+        mqtt->wq.head = 0;
+    }
+}
+
+/* pending bytes as at most two iovecs. */
+static int
+__wq_iov(struct libmqtt *mqtt, struct iovec iov[2]) {
+    int first;
+
+    first = mqtt->wq.size - mqtt->wq.head;
+    if (first >= mqtt->wq.n) {
+        iov[0].iov_base = mqtt->wq.s + mqtt->wq.head;
+        iov[0].iov_len = mqtt->wq.n;
+        return 1;
+    }
+    iov[0].iov_base = mqtt->wq.s + mqtt->wq.head;
+    iov[0].iov_len = first;
+    iov[1].iov_base = mqtt->wq.s;
+    iov[1].iov_len = mqtt->wq.n - first;
+    return 2;
+}
+
+static void
+__wq_watermark(struct libmqtt *mqtt) {
+    if (!mqtt->wq.blocked && mqtt->wq.n >= mqtt->wq.high) {
+        mqtt->wq.blocked = 1;
+        if (mqtt->cb.watermark)
+            mqtt->cb.watermark(mqtt, mqtt->ud, 1, mqtt->wq.n);
+    } else if (mqtt->wq.blocked && mqtt->wq.n <= mqtt->wq.low) {
+        mqtt->wq.blocked = 0;
+        if (mqtt->cb.watermark)
+            mqtt->cb.watermark(mqtt, mqtt->ud, 0, mqtt->wq.n);
+    }
+}
+
+/* drop unsent output when the connection goes away. */
+static void
+__wq_reset(struct libmqtt *mqtt) {
+    mqtt__batch_reset(&mqtt->batch.b);
+    mqtt->wq.n = 0;
+    mqtt->wq.head = 0;
+    mqtt->wq.shutdown = 0;
+    __wq_watermark(mqtt);
+}
+
+#ifdef HAVE_OPENSSL
+/* map a failed SSL_read/SSL_write to the read/write convention. */
+static int
+__tls_error(struct libmqtt *mqtt, int rc) {
+    switch (SSL_get_error(mqtt->tls.ssl, rc)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
         return -1;
+    case SSL_ERROR_ZERO_RETURN:
+        /* close_notify from the broker. */
+        return 0;
+    default:
+        if (errno == 0 || errno == EAGAIN) {
+            errno = EIO;
+        }
+        return -1;
+    }
+}
+
+static int
+__tls_read(struct libmqtt *mqtt, char *buf, int size) {
+    int rc;
+
+    ERR_clear_error();
+    if ((rc = SSL_read(mqtt->tls.ssl, buf, size)) > 0) {
+        return rc;
+    }
+    return __tls_error(mqtt, rc);
+}
+
+/* records are cut from a copy of the iovs in tls.buf, a write retried
+ * after EAGAIN then passes the same buffer with at least the same bytes,
+ * as SSL_write requires. */
+static int
+__tls_writev(struct libmqtt *mqtt, const struct iovec *iov, int count) {
+    int i, off, len, n, rc, total;
+
+    total = 0;
+    i = 0;
+    off = 0;
+    while (i < count) {
+        for (n = 0; i < count && n < LIBMQTT_TLS_RECORD; n += len) {
+            len = iov[i].iov_len - off;
+            if (len > LIBMQTT_TLS_RECORD - n) {
+                len = LIBMQTT_TLS_RECORD - n;
+            }
+            memcpy(mqtt->tls.buf + n, (char *)iov[i].iov_base + off, len);
+            off += len;
+            if (off == (int)iov[i].iov_len) {
+                i++;
+                off = 0;
+            }
+        }
+        if (n == 0) {
+            break;
+        }
+        ERR_clear_error();
+        if ((rc = SSL_write(mqtt->tls.ssl, mqtt->tls.buf, n)) <= 0) {
+            if (0 == (rc = __tls_error(mqtt, rc))) {
+                errno = EPIPE;
+                rc = -1;
+            }
+            return total > 0 ? total : rc;
+        }
+        total += rc;
+    }
+    return total;
+}
+
+static void
+__tls_free(struct libmqtt *mqtt) {
+    SSL_free(mqtt->tls.ssl);
+    mqtt->tls.ssl = 0;
+}
+#endif
+
+static int
+__io_read(struct libmqtt *mqtt, int fd, char *buf, int size) {
+#ifdef HAVE_OPENSSL
+    if (mqtt->tls.ssl) {
+        return __tls_read(mqtt, buf, size);
+    }
+#endif
+    return read(fd, buf, size);
+}
+
+static int
+__io_writev(struct libmqtt *mqtt, int fd, const struct iovec *iov, int count) {
+#ifdef HAVE_OPENSSL
+    if (mqtt->tls.ssl) {
+        return __tls_writev(mqtt, iov, count);
+    }
+#endif
+    return writev(fd, iov, count);
+}
+
+/* a short read drains a plain socket, tls returns one record per read. */
+static int
+__io_drained(struct libmqtt *mqtt, int nread) {
+#ifdef HAVE_OPENSSL
+    if (mqtt->tls.ssl) {
+        return 0;
+    }
+#endif
+    return nread < mqtt->rd.size;
+}
+
+/* the rest of a tls record larger than the read buffer is already off
+ * the socket and does not wake the poller. */
+static int
+__io_pending(struct libmqtt *mqtt) {
+#ifdef HAVE_OPENSSL
+    return mqtt->tls.ssl && !mqtt->conn.on && SSL_pending(mqtt->tls.ssl) > 0;
+#else
+    (void)mqtt;
+    return 0;
+#endif
+}
+
+/* half close once the output is out, tls sends close_notify first. */
+static void
+__io_shutdown(struct libmqtt *mqtt) {
+#ifdef HAVE_OPENSSL
+    if (mqtt->tls.ssl) {
+        ERR_clear_error();
+        SSL_shutdown(mqtt->tls.ssl);
+    }
+#endif
+    shutdown(mqtt->fd, SHUT_WR);
+}
+
+static void
+__writable(aeEventLoop *el, int fd, void *privdata, int mask) {
+    struct libmqtt *mqtt;
+    struct iovec iov[2];
+    int count, nwrite;
+
+    mqtt = (struct libmqtt *)privdata;
+    while (mqtt->wq.n > 0) {
+        count = __wq_iov(mqtt, iov);
+        nwrite = __io_writev(mqtt, fd, iov, count);
+        if (nwrite == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            /* the read side sees the error and closes the connection. */
+            mqtt->wq.n = 0;
+            mqtt->wq.head = 0;
+            break;
+        }
+        __wq_drop(mqtt, nwrite);
+    }
+    aeDeleteFileEvent(el, fd, AE_WRITABLE);
+    if (mqtt->wq.shutdown) {
+        mqtt->wq.shutdown = 0;
+        __io_shutdown(mqtt);
+    }
+    __wq_watermark(mqtt);
+}
+
+/* write what the socket takes now and queue the rest, output already
+ * queued is sent first so packets never reorder. */
+static int
+__send(struct libmqtt *mqtt, const struct iovec *iov, int count) {
+    int i, size, nwrite;
+
+    size = 0;
+    for (i = 0; i < count; i++) {
+        size += iov[i].iov_len;
+    }
+    nwrite = 0;
+    if (mqtt->wq.n == 0 && !mqtt->conn.on) {
+        do {
+            nwrite = __io_writev(mqtt, mqtt->fd, iov, count);
+        } while (nwrite == -1 && errno == EINTR);
+        if (nwrite == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return -1;
+            }
+            nwrite = 0;
+        }
+    }
+    mqtt->t.send = mqtt->t.now;
+    if (nwrite == size) {
+        return 0;
+    }
+    for (i = 0; i < count; i++) {
+        if (nwrite >= (int)iov[i].iov_len) {
+            nwrite -= iov[i].iov_len;
+            continue;
+        }
+        if (__wq_push(mqtt, (char *)iov[i].iov_base + nwrite, iov[i].iov_len - nwrite)) {
+            return -1;
+        }
+        nwrite = 0;
+    }
+    /* while connecting the connect or handshake handler owns the fd. */
+    if (!mqtt->conn.on && !(aeGetFileEvents(mqtt->el, mqtt->fd) & AE_WRITABLE)) {
+        if (AE_ERR == aeCreateFileEvent(mqtt->el, mqtt->fd, AE_WRITABLE, __writable, mqtt)) {
+            return -1;
+        }
+    }
+    __wq_watermark(mqtt);
+    return 0;
+}
+
+/* write the batch, together with any queued output in one writev. */
+static int
+__flush(struct libmqtt *mqtt) {
+    struct iovec iov[3];
+    int count, nwrite, rc;
+
+    if (mqtt->batch.b.n == 0) {
+        return 0;
+    }
+    if (mqtt->wq.n == 0 || mqtt->conn.on) {
+        iov[0].iov_base = mqtt->batch.b.s;
+        iov[0].iov_len = mqtt->batch.b.n;
+        rc = __send(mqtt, iov, 1);
+        mqtt__batch_reset(&mqtt->batch.b);
+        return rc;
+    }
+    count = __wq_iov(mqtt, iov);
+    iov[count].iov_base = mqtt->batch.b.s;
+    iov[count].iov_len = mqtt->batch.b.n;
+    do {
+        nwrite = __io_writev(mqtt, mqtt->fd, iov, count + 1);
+    } while (nwrite == -1 && errno == EINTR);
+    if (nwrite == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            mqtt__batch_reset(&mqtt->batch.b);
+            return -1;
+        }
+        nwrite = 0;
     }
+    if (nwrite >= mqtt->wq.n) {
+        nwrite -= mqtt->wq.n;
+        __wq_drop(mqtt, mqtt->wq.n);
+    } else {
+        __wq_drop(mqtt, nwrite);
+        nwrite = 0;
+    }
+    rc = 0;
+    if (nwrite < mqtt->batch.b.n) {
+        rc = __wq_push(mqtt, mqtt->batch.b.s + nwrite, mqtt->batch.b.n - nwrite);
+    }
+    mqtt__batch_reset(&mqtt->batch.b);
     mqtt->t.send = mqtt->t.now;
+    if (mqtt->wq.n == 0) {
+        aeDeleteFileEvent(mqtt->el, mqtt->fd, AE_WRITABLE);
+    }
+    __wq_watermark(mqtt);
+    return rc;
+}
+
+/* in batch mode queue the packet, one write then covers the whole batch.
+ * returns 1 if the packet is too large to queue and must be written. */
+static int
+__batch(struct libmqtt *mqtt, const struct iovec *iov, int count) {
+    int i, size;
+
+    size = 0;
+    for (i = 0; i < count; i++) {
+        size += iov[i].iov_len;
+    }
+    if (mqtt->batch.b.n + size > LIBMQTT_BATCH_BUFF && __flush(mqtt)) {
+        return -1;
+    }
+    if (size > LIBMQTT_BATCH_BUFF) {
+        return 1;
+    }
+    for (i = 0; i < count; i++) {
+        if (mqtt__batch_write(&mqtt->batch.b, iov[i].iov_base, iov[i].iov_len)) {
+            return -1;
+        }
+    }
+    mqtt->batch.b.count++;
+    return 0;
+}
+
+static int
+__writev(struct libmqtt *mqtt, const struct iovec *iov, int count) {
+    int rc;
+
+    /* nothing is queued while disconnected, it would precede CONNECT. */
+    if (mqtt->fd <= 0) {
+        return -1;
+    }
+    if ((mqtt->batch.on || mqtt->batch.cork) && 1 != (rc = __batch(mqtt, iov, count))) {
+        return rc;
+    }
+    return __send(mqtt, iov, count);
+}
+
+static int
+__write(struct libmqtt *mqtt, const char *data, int size) {
+    struct iovec iov;
+
+    iov.iov_base = (void *)data;
+    iov.iov_len = size;
+    return __writev(mqtt, &iov, 1);
+}
+
+static int
+__out_reserve(struct libmqtt *mqtt, int size) {
+    char *s;
+
+    if (size > mqtt->out.size) {
+        s = realloc(mqtt->out.s, size);
+        if (!s) {
+            return -1;
+        }
+        mqtt->out.s = s;
+        mqtt->out.size = size;
+    }
+    return 0;
+}
+
+/* encode into the client's reusable output buffer, grown on demand. */
+static int
+__serialize(struct libmqtt *mqtt, struct mqtt_packet *p, struct mqtt_b *b) {
+    int size;
+
+    size = mqtt__packet_size(p);
+    if (size < 0 || __out_reserve(mqtt, size)) {
+        return -1;
+    }
+    b->s = mqtt->out.s;
+    b->n = mqtt__serialize_into(p, b->s, size);
     return 0;
 }
 
+/* encode a PUBLISH header into the output buffer, the payload is sent
+ * straight from the caller's memory. */
+static int
+__serialize_iov(struct libmqtt *mqtt, struct mqtt_packet *p, struct iovec iov[2]) {
+    int size;
+
+    size = mqtt__packet_size(p);
+    if (size < 0) {
+        return -1;
+    }
+    size -= p->payload.n;
+    if (__out_reserve(mqtt, size)) {
+        return -1;
+    }
+    return mqtt__serialize_iov(p, mqtt->out.s, size, iov);
+}
+
+static long long
+__nstime(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* the first packet dispatched after the poller returned takes a sample. */
+static void
+__lat_record(struct libmqtt *mqtt) {
+    long long ns;
+    int shift;
+
+    if (!mqtt->lat.wake) {
+        return;
+    }
+    ns = __nstime() - mqtt->lat.wake;
+    mqtt->lat.wake = 0;
+    if (ns < 0) {
+        ns = 0;
+    }
+    for (shift = 0; ns >= 16; shift++) {
+        ns >>= 1;
+    }
+    mqtt->lat.hist[shift * 8 + ns]++;
+    mqtt->lat.count++;
+}
+
+/* lower bound in ns of the bucket holding the pct percentile. */
+static int
+__lat_percentile(struct libmqtt *mqtt, int pct) {
+    uint32_t n, target;
+    int i, shift;
+
+    if (mqtt->lat.count == 0) {
+        return 0;
+    }
+    target = (uint32_t)(((uint64_t)mqtt->lat.count * pct + 99) / 100);
+    n = 0;
+    for (i = 0; i < LIBMQTT_LAT_BUCKETS; i++) {
+        n += mqtt->lat.hist[i];
+        if (n >= target) {
+            break;
+        }
+    }
+    if (i < 16) {
+        return i;
+    }
+    shift = i / 8 - 1;
+    return (int)((long long)(i - shift * 8) << shift);
+}
+
+/* the poller returned, the first callback in this iteration measures from here. */
+static void
+__after_sleep(aeEventLoop *el) {
+    struct libmqtt *mqtt;
+
+    mqtt = (struct libmqtt *)el->privdata;
+    mqtt->lat.wake = __nstime();
+}
+
+/* grow the read buffer when reads fill it, shrink it after a run of
+ * LIBMQTT_READ_SHRINK reads that use less than a quarter. */
+static void
+__read_adapt(struct libmqtt *mqtt, int nread) {
+    char *s;
+    int size;
+
+    size = mqtt->rd.size;
+    if (nread == size) {
+        size *= 2;
+        mqtt->rd.idle = 0;
+    } else if (nread < size / 4) {
+        if (++mqtt->rd.idle < LIBMQTT_READ_SHRINK) {
+            return;
+        }
+        size /= 2;
+        mqtt->rd.idle = 0;
+    } else {
+        mqtt->rd.idle = 0;
+    }
+    if (size > mqtt->rd.max) {
+        size = mqtt->rd.max;
+    }
+    if (size < LIBMQTT_READ_BUFF) {
+        size = LIBMQTT_READ_BUFF;
+    }
+    if (size != mqtt->rd.size && (s = realloc(mqtt->rd.s, size))) {
+        mqtt->rd.s = s;
+        mqtt->rd.size = size;
+    }
+}
+
+/* read until the socket is drained or the budget is spent, complete
+ * packets are parsed in place from the read buffer. */
+static void
+__read(aeEventLoop *el, int fd, void *privdata, int mask) {
+    struct libmqtt *mqtt;
+    int nread, budget, rc;
+    struct mqtt_b b;
+
+    mqtt = (struct libmqtt *)privdata;
+    for (budget = LIBMQTT_READ_BUDGET; budget > 0; budget--) {
+        nread = __io_read(mqtt, fd, mqtt->rd.s, mqtt->rd.size);
+        if (nread == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (nread == -1 && errno == EINTR) {
+            continue;
+        }
+        b.s = mqtt->rd.s;
+        b.n = nread;
+        rc = nread <= 0 || mqtt__parse(&mqtt->p, mqtt, &b);
+        /* a callback may have dropped the connection already. */
+        if (mqtt->fd != fd) {
+            return;
+        }
+        if (rc) {
+            __close(mqtt);
+            __lost(mqtt);
+            return;
+        }
+        /* a short read means the socket is drained, skip the EAGAIN. */
+        if (__io_drained(mqtt, nread)) {
+            __read_adapt(mqtt, nread);
+            break;
+        }
+        __read_adapt(mqtt, nread);
+    }
+    if (!mqtt->batch.cork) {
+        __flush(mqtt);
+    }
+}
+
+static void
+__free_pub(struct libmqtt_pub *pub) {
+    if (pub->zc) {
+        /* the kernel still reads the payload, it is freed on completion. */
+        pub->zc->pub = 0;
+    } else if (pub->p.payload) {
+        free(pub->p.payload);
+    }
+    free(pub->p.topic);
+    free(pub);
+}
+
+/* unpin the zerocopy sends numbered lo to hi. */
+static void
+__zc_release(struct libmqtt_zc **head, struct libmqtt_zc **tail, uint32_t lo, uint32_t hi) {
+    struct libmqtt_zc **pp, *zc;
+
+    pp = head;
+    *tail = 0;
+    while (*pp) {
+        zc = *pp;
+        if (zc->seq - lo <= hi - lo) {
+            *pp = zc->next;
+            if (zc->pub) {
+                zc->pub->zc = 0;
+            } else {
+                free(zc->buf);
+            }
+            free(zc);
+        } else {
+            *tail = zc;
+            pp = &zc->next;
+        }
+    }
+}
+
+/* the kernel may still read these buffers, they are leaked, not freed. */
+static void
+__zc_forget(struct libmqtt_zc *head) {
+    struct libmqtt_zc *zc;
+
+    while ((zc = head)) {
+        head = zc->next;
+        free(zc);
+    }
+}
+
+#ifdef LIBMQTT_ZEROCOPY
+static void
+__zc_enable(struct libmqtt *mqtt, int fd) {
+    int on = 1;
+
+    mqtt->zc.on = mqtt->zc.threshold > 0
+#ifdef HAVE_OPENSSL
+        && !mqtt->tls.ctx
+#endif
+        && 0 == setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof on);
+}
+
+/* read send completions from the socket error queue. */
+static void
+__zc_reap(struct libmqtt *mqtt, int fd, struct libmqtt_zc **head, struct libmqtt_zc **tail) {
+    char control[128];
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    struct sock_extended_err *serr;
+
+    while (*head) {
+        memset(&msg, 0, sizeof msg);
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof control;
+        if (-1 == recvmsg(fd, &msg, MSG_ERRQUEUE)) {
+            break;
+        }
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+                && !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            serr = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno != 0) {
+                continue;
+            }
+            /* the kernel copied anyway (loopback), plain sends are cheaper. */
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                mqtt->zc.on = 0;
+            }
+            __zc_release(head, tail, serr->ee_info, serr->ee_data);
+        }
+    }
+}
+#else
+static void
+__zc_enable(struct libmqtt *mqtt, int fd) {
+    (void)fd;
+    mqtt->zc.on = 0;
+}
+
+static void
+__zc_reap(struct libmqtt *mqtt, int fd, struct libmqtt_zc **head, struct libmqtt_zc **tail) {
+    (void)mqtt;
+    (void)fd;
+    (void)head;
+    (void)tail;
+}
+#endif
+
+/* a socket closed with sends still pinned stays open, shut down, until
+ * its completions are read, so the payloads are not freed under the kernel. */
+static void
+__zc_linger(struct libmqtt *mqtt) {
+    struct libmqtt_linger *l;
+
+    __zc_reap(mqtt, mqtt->fd, &mqtt->zc.head, &mqtt->zc.tail);
+    if (!mqtt->zc.head) {
+        close(mqtt->fd);
+        return;
+    }
+    /* reserved by the first pinned send, closing never allocates. */
+    l = mqtt->zc.spare;
+    mqtt->zc.spare = 0;
+    shutdown(mqtt->fd, SHUT_RDWR);
+    l->fd = mqtt->fd;
+    l->head = mqtt->zc.head;
+    l->tail = mqtt->zc.tail;
+    l->next = mqtt->zc.linger;
+    mqtt->zc.linger = l;
+    mqtt->zc.head = 0;
+    mqtt->zc.tail = 0;
+}
+
+static void
+__zc_linger_reap(struct libmqtt *mqtt) {
+    struct libmqtt_linger **pp, *l;
+
+    pp = &mqtt->zc.linger;
+    while ((l = *pp)) {
+        __zc_reap(mqtt, l->fd, &l->head, &l->tail);
+        if (l->head) {
+            pp = &l->next;
+            continue;
+        }
+        *pp = l->next;
+        close(l->fd);
+        free(l);
+    }
+}
+
+/* corked output produced during the last loop iteration goes out here,
+ * zerocopy completions wake the loop with POLLERR and are read here too. */
+static void
+__before_sleep(aeEventLoop *el) {
+    struct libmqtt *mqtt;
+
+    mqtt = (struct libmqtt *)el->privdata;
+    while (mqtt->fd > 0 && __io_pending(mqtt)) {
+        __read(el, mqtt->fd, mqtt, AE_READABLE);
+    }
+    if (mqtt->fd > 0) {
+        if (mqtt->zc.head) {
+            __zc_reap(mqtt, mqtt->fd, &mqtt->zc.head, &mqtt->zc.tail);
+        }
+        __flush(mqtt);
+    }
+    if (mqtt->zc.linger) {
+        __zc_linger_reap(mqtt);
+    }
+}
+
+static void
+__log(struct libmqtt *mqtt, const char *fmt, ...) {
+    int n;
+    va_list ap;
+
+    if (!mqtt->log) return;
+    n = snprintf(mqtt->logbuf, LIBMQTT_LOG_BUFF, "Client %.*s ", mqtt->c.client_id.n, mqtt->c.client_id.s);
+    va_start(ap, fmt);
+    n += vsnprintf(mqtt->logbuf+n, LIBMQTT_LOG_BUFF-n, fmt, ap);
+    va_end(ap);
+    mqtt->logbuf[n] = '\0';
+    mqtt->log(mqtt->ud, mqtt->logbuf);
+}
+
+static void
+__check_retry(struct libmqtt *mqtt) {
+    struct libmqtt_pub *pub, *next;
+
+    for (pub = mqtt->pub.head; pub; pub = next) {
+        next = pub->next;
+        if (mqtt->t.now - pub->t > LIBMQTT_TIME_RETRY) {
+            switch (pub->s) {
+            case LIBMQTT_ST_SEND_PUBLUSH:
+            case LIBMQTT_ST_WAIT_PUBACK:
+            case LIBMQTT_ST_WAIT_PUBREC:
+                {
+                    struct mqtt_packet p;
+                    struct iovec iov[2];
+                    int count;
+
+                    memset(&p, 0, sizeof p);
+                    p.h.type = PUBLISH;
+                    p.h.dup = 1;
+                    p.h.retain = pub->p.retain;
+                    p.h.qos = pub->p.qos;
+                    p.v.publish.packet_id = pub->p.packet_id;
+                    p.v.publish.topic_name.s = pub->p.topic;
+                    p.v.publish.topic_name.n = strlen(pub->p.topic);
+                    p.payload.s = pub->p.payload;
+                    p.payload.n = pub->p.length;
+
+                    if (-1 == (count = __serialize_iov(mqtt, &p, iov))) {
+                        break;
+                    }
+
+                    if (0 == __writev(mqtt, iov, count)) {
+                        __log(mqtt, "sending PUBLISH (d%d, q%d, r%d, m%d, \'%s\', ...(%d bytes))",
+                              1, pub->p.qos, pub->p.retain, pub->p.packet_id, pub->p.topic, pub->p.length);
+                        if (pub->p.qos == MQTT_QOS_0) {
+                            __delete_pub(mqtt, pub);
+                            break;
+                        } else if (pub->p.qos == MQTT_QOS_1) {
+                            pub->s = LIBMQTT_ST_WAIT_PUBACK;
+                        } else {
+                            pub->s = LIBMQTT_ST_WAIT_PUBREC;
+                        }
+                    }
+                    pub->t = mqtt->t.now;
+                }
+                break;
+            case LIBMQTT_ST_SEND_PUBACK:
+                {
+                    char puback[] = MQTT_PUBACK(pub->p.packet_id);
+                    if (0 == __write(mqtt, puback, sizeof puback)) {
+                        __log(mqtt, "sending PUBACK (id: %"PRIu16")", pub->p.packet_id);
+                        __delete_pub(mqtt, pub);
+                    } else {
+                        pub->t = mqtt->t.now;
+                    }
+                }
+                break;
+            case LIBMQTT_ST_SEND_PUBREC:
+                {
+                    char pubrec[] = MQTT_PUBREC(pub->p.packet_id);
+                    if (0 == __write(mqtt, pubrec, sizeof pubrec)) {
+                        __log(mqtt, "sending PUBREC (id: %"PRIu16")", pub->p.packet_id);
+                        pub->s = LIBMQTT_ST_WAIT_PUBREL;
+                    }
+                    pub->t = mqtt->t.now;
+                }
+                break;
+            case LIBMQTT_ST_SEND_PUBREL:
+                {
+                    char pubrel[] = MQTT_PUBREL(pub->p.packet_id);
+                    if (0 == __write(mqtt, pubrel, sizeof pubrel)) {
+                        __log(mqtt, "sending PUBREL (id: %"PRIu16")", pub->p.packet_id);
+                        pub->s = LIBMQTT_ST_WAIT_PUBCOMP;
+                    }
+                    pub->t = mqtt->t.now;
+                }
+                break;
+            case LIBMQTT_ST_SEND_PUBCOMP:
+                {
+                    char pubcomp[] = MQTT_PUBCOMP(pub->p.packet_id);
+                    if (0 == __write(mqtt, pubcomp, sizeof pubcomp)) {
+                        __log(mqtt, "sending PUBCOMP (id: %"PRIu16")", pub->p.packet_id);
+                        __delete_pub(mqtt, pub);
+                    } else {
+                        pub->t = mqtt->t.now;
+                    }
+                }
+                break;
+            case LIBMQTT_ST_WAIT_PUBREL:
+                {
+                    char pubrec[] = MQTT_PUBREC(pub->p.packet_id);
+                    if (0 == __write(mqtt, pubrec, sizeof pubrec)) {
+                        __log(mqtt, "sending PUBREC (id: %"PRIu16")", pub->p.packet_id);
+                    }
+                    pub->t = mqtt->t.now;
+                }
+                break;
+            case LIBMQTT_ST_WAIT_PUBCOMP:
+                {
+                    char pubrel[] = MQTT_PUBREL(pub->p.packet_id);
+                    if (0 == __write(mqtt, pubrel, sizeof pubrel)) {
+                        __log(mqtt, "sending PUBREL (id: %"PRIu16")", pub->p.packet_id);
+                    }
+                    pub->t = mqtt->t.now;
+                }
+                break;
+            }
+        }
+    }
+}
+
+static int
+__update(aeEventLoop *el, long long id, void *privdata) {
+    struct libmqtt *mqtt;
+
+    mqtt = (struct libmqtt *)privdata;
+    mqtt->t.now += 1;
+
+    if (mqtt->t.ping > 0 && (mqtt->t.now - mqtt->t.ping) > mqtt->c.keep_alive) {
+        if (mqtt->fd > 0) {
+            __io_shutdown(mqtt);
+        }
+        return 0;
+    }
+
+    if (mqtt->t.ping == 0 && (mqtt->t.now - mqtt->t.send) >= mqtt->c.keep_alive) {
+        char b[] = MQTT_PINGREQ;
+        if (0 == __write(mqtt, b, sizeof b)) {
+            mqtt->t.ping = mqtt->t.now;
+            __log(mqtt, "sending PINGREQ");
+        }
+    }
+    __check_retry(mqtt);
+    __flush(mqtt);
+    return 1000;
+}
+
+/* resolve the broker host, the answer is cached for dns.ttl seconds and
+ * a stale answer is kept while the resolver fails. */
+static int
+__resolve(struct libmqtt *mqtt) {
+    char ip[INET6_ADDRSTRLEN];
+    time_t now;
+
+    now = time(0);
+    if (mqtt->dns.ip[0] && now < mqtt->dns.expire) {
+        return 0;
+    }
+    if (ANET_ERR == anetResolve(0, mqtt->host, ip, sizeof ip)) {
+        return mqtt->dns.ip[0] ? 0 : -1;
+    }
+    memcpy(mqtt->dns.ip, ip, sizeof ip);
+    mqtt->dns.expire = now + mqtt->dns.ttl;
+    return 0;
+}
+
+static void
+__close(struct libmqtt *mqtt) {
+    __wq_reset(mqtt);
+    aeDeleteFileEvent(mqtt->el, mqtt->fd, AE_READABLE | AE_WRITABLE);
+    aeDeleteTimeEvent(mqtt->el, mqtt->id);
+    mqtt->id = -1;
+    if (mqtt->conn.on) {
+        aeDeleteTimeEvent(mqtt->el, mqtt->conn.id);
+        mqtt->conn.on = 0;
+    }
+#ifdef HAVE_OPENSSL
+    __tls_free(mqtt);
+#endif
+    /* a new socket numbers its zerocopy sends from 0 again. */
+    __zc_linger(mqtt);
+    mqtt->zc.seq = 0;
+    mqtt->fd = 0;
+}
+
+static void
+__connect_fail(struct libmqtt *mqtt) {
+    /* the address may have moved, resolve again on the next attempt. */
+    mqtt->dns.expire = 0;
+    __close(mqtt);
+    __lost(mqtt);
+}
+
+/* monotonic, so clock steps do not skew the reported reconnect time. */
+static long long
+__mstime(void) {
+    return __nstime() / 1000000;
+}
+
+static uint32_t
+__random(struct libmqtt *mqtt) {
+    uint32_t x;
+
+    x = mqtt->reconn.seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    mqtt->reconn.seed = x;
+    return x;
+}
+
+static void
+__reconnect_report(struct libmqtt *mqtt, int rc) {
+    if (mqtt->cb.reconnect)
+        mqtt->cb.reconnect(mqtt, mqtt->ud, mqtt->reconn.attempt, (int)(__mstime() - mqtt->reconn.lost), rc);
+}
+
+static int
+__reconnect(aeEventLoop *el, long long id, void *privdata) {
+    struct libmqtt *mqtt;
+    (void)el;
+    (void)id;
+
+    mqtt = (struct libmqtt *)privdata;
+    mqtt->reconn.id = -1;
+    mqtt->reconn.attempt++;
+    mqtt__parse_reset(&mqtt->p);
+    mqtt->t.ping = 0;
+    mqtt->t.send = mqtt->t.now;
+    if (__connect(mqtt)) {
+        __lost(mqtt);
+    } else if (__send_connect(mqtt)) {
+        __close(mqtt);
+        __lost(mqtt);
+    }
+    return AE_NOMORE;
+}
+
+/* the next delay is random between base and three times the last one,
+ * clients dropped together by a broker restart spread out quickly. */
+static void
+__reconnect_schedule(struct libmqtt *mqtt) {
+    int hi, delay;
+    long long id;
+
+    hi = mqtt->reconn.delay > mqtt->reconn.max / 3 ? mqtt->reconn.max : mqtt->reconn.delay * 3;
+    if (hi < mqtt->reconn.base) {
+        hi = mqtt->reconn.base;
+    }
+    delay = mqtt->reconn.base + __random(mqtt) % (uint32_t)(hi - mqtt->reconn.base + 1);
+    mqtt->reconn.delay = delay;
+    __log(mqtt, "reconnecting in %d ms (attempt %d)", delay, mqtt->reconn.attempt + 1);
+    if (AE_ERR == (id = aeCreateTimeEvent(mqtt->el, delay, __reconnect, mqtt, 0))) {
+        aeStop(mqtt->el);
+        return;
+    }
+    mqtt->reconn.id = id;
+}
+
+/* the connection is gone, retry once it had been accepted, else stop. */
+static void
+__lost(struct libmqtt *mqtt) {
+    if (mqtt->disconnect || mqtt->reconn.base <= 0 || (!mqtt->reconn.up && !mqtt->reconn.attempt)) {
+        aeStop(mqtt->el);
+        return;
+    }
+    if (mqtt->reconn.attempt > 0) {
+        __reconnect_report(mqtt, LIBMQTT_ERROR_CONNECT);
+    } else {
+        mqtt->reconn.lost = __mstime();
+        mqtt->reconn.delay = mqtt->reconn.base;
+    }
+    __reconnect_schedule(mqtt);
+}
+
+/* the tcp connection is up, start reading and send what was queued. */
+static int
+__established(struct libmqtt *mqtt) {
+    long long id;
+
+    if (AE_ERR == aeCreateFileEvent(mqtt->el, mqtt->fd, AE_READABLE, __read, mqtt)) {
+        return -1;
+    }
+    if (mqtt->c.keep_alive > 0) {
+        if (AE_ERR == (id = aeCreateTimeEvent(mqtt->el, 1000, __update, mqtt, 0))) {
+            return -1;
+        }
+        mqtt->id = id;
+    }
+    if (mqtt->wq.n > 0) {
+        if (AE_ERR == aeCreateFileEvent(mqtt->el, mqtt->fd, AE_WRITABLE, __writable, mqtt)) {
+            return -1;
+        }
+        __writable(mqtt->el, mqtt->fd, mqtt, AE_WRITABLE);
+    }
+    return 0;
+}
+
+#ifdef HAVE_OPENSSL
+static void
+__tls_log(struct libmqtt *mqtt, const char *what) {
+    char err[256];
+    unsigned long e;
+    long verify;
+
+    if (mqtt->conn.on && mqtt->tls.ssl && X509_V_OK != (verify = SSL_get_verify_result(mqtt->tls.ssl))) {
+        __log(mqtt, "%s: %s", what, X509_verify_cert_error_string(verify));
+    } else if ((e = ERR_get_error())) {
+        ERR_error_string_n(e, err, sizeof err);
+        __log(mqtt, "%s: %s", what, err);
+    } else {
+        __log(mqtt, "%s: %s", what, errno ? strerror(errno) : "connection closed");
+    }
+}
+
+/* keep a copy of the newest resumable session: tls 1.3 tickets arrive
+ * after the handshake, and the live session is marked unresumable if the
+ * connection then dies with an error, as it does when a broker goes away. */
+static int
+__tls_new_session(SSL *ssl, SSL_SESSION *sess) {
+    struct libmqtt *mqtt;
+    SSL_SESSION *copy;
+
+    mqtt = (struct libmqtt *)SSL_get_app_data(ssl);
+    if (SSL_SESSION_is_resumable(sess) && (copy = SSL_SESSION_dup(sess))) {
+        SSL_SESSION_free(mqtt->tls.sess);
+        mqtt->tls.sess = copy;
+    }
+    return 0;
+}
+
+/* the session is only resumed, never used for early data: a replayed
+ * CONNECT could take the session over from the live client. */
+static int
+__tls_open(struct libmqtt *mqtt) {
+    unsigned char addr[sizeof(struct in6_addr)];
+    SSL *ssl;
+
+    if (!(ssl = SSL_new(mqtt->tls.ctx))) {
+        goto e1;
+    }
+    SSL_set_app_data(ssl, mqtt);
+    if (!SSL_set_fd(ssl, mqtt->fd)) {
+        goto e2;
+    }
+    if (!mqtt->local) {
+        if (1 == inet_pton(AF_INET, mqtt->host, addr) || 1 == inet_pton(AF_INET6, mqtt->host, addr)) {
+            if (!X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), mqtt->host)) {
+                goto e2;
+            }
+        } else if (!SSL_set_tlsext_host_name(ssl, mqtt->host) || !SSL_set1_host(ssl, mqtt->host)) {
+            goto e2;
+        }
+    }
+    if (mqtt->tls.sess && !SSL_set_session(ssl, mqtt->tls.sess)) {
+        goto e2;
+    }
+    SSL_set_connect_state(ssl);
+    mqtt->tls.ssl = ssl;
+    return 0;
+
+e2:
+    SSL_free(ssl);
+e1:
+    __tls_log(mqtt, "tls setup failed");
+    return -1;
+}
+
+static void
+__handshake(aeEventLoop *el, int fd, void *privdata, int mask) {
+    struct libmqtt *mqtt;
+    SSL *ssl;
+    int rc;
+
+    mqtt = (struct libmqtt *)privdata;
+    ssl = mqtt->tls.ssl;
+    aeDeleteFileEvent(el, fd, AE_READABLE | AE_WRITABLE);
+    ERR_clear_error();
+    if (1 == (rc = SSL_do_handshake(ssl))) {
+        aeDeleteTimeEvent(el, mqtt->conn.id);
+        mqtt->conn.on = 0;
+        __log(mqtt, "%s %s, %s", SSL_get_version(ssl), SSL_get_cipher_name(ssl),
+              SSL_session_reused(ssl) ? "resumed session" : "full handshake");
+        if (__established(mqtt)) {
+            goto e1;
+        }
+        return;
+    }
+    switch (SSL_get_error(ssl, rc)) {
+    case SSL_ERROR_WANT_READ:
+        mask = AE_READABLE;
+        break;
+    case SSL_ERROR_WANT_WRITE:
+        mask = AE_WRITABLE;
+        break;
+    default:
+        __tls_log(mqtt, "tls handshake failed");
+        /* do not offer a session the broker may be refusing again. */
+        SSL_SESSION_free(mqtt->tls.sess);
+        mqtt->tls.sess = 0;
+        goto e1;
+    }
+    if (AE_ERR == aeCreateFileEvent(el, fd, mask, __handshake, mqtt)) {
+        goto e1;
+    }
+    return;
+
+e1:
+    __connect_fail(mqtt);
+}
+#endif
+
 static void
-__read(aeEventLoop *el, int fd, void *privdata, int mask) {
+__connected(aeEventLoop *el, int fd, void *privdata, int mask) {
     struct libmqtt *mqtt;
-    int nread;
-    char buff[LIBMQTT_READ_BUFF];
-    struct mqtt_b b;
+    socklen_t len;
+    int err;
+    (void)mask;
 
     mqtt = (struct libmqtt *)privdata;
-    nread = read(fd, buff, sizeof(buff));
-    if (nread == -1 && errno == EAGAIN) {
-        return;
+    err = 0;
+    len = sizeof err;
+    if (-1 == getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len)) {
+        err = errno;
+    }
+    aeDeleteFileEvent(el, fd, AE_WRITABLE);
+    if (err) {
+        if (mqtt->local) {
+            __log(mqtt, "connect to %s failed: %s", mqtt->host, strerror(err));
+        } else {
+            __log(mqtt, "connect to %s:%d failed: %s", mqtt->host, mqtt->port, strerror(err));
+        }
+        goto e1;
     }
-    b.s = buff;
-    b.n = nread;
-    if (nread <= 0 || mqtt__parse(&mqtt->p, mqtt, &b)) {
-        aeDeleteFileEvent(el, fd, AE_READABLE);
-        aeDeleteTimeEvent(el, mqtt->id);
-        close(fd);
-        mqtt->fd = 0;
-        if (nread == 0 || __connect(mqtt)) {
-            aeStop(el);
+#ifdef HAVE_OPENSSL
+    /* the connect timeout covers the handshake too. */
+    if (mqtt->tls.ctx) {
+        if (__tls_open(mqtt)) {
+            goto e1;
         }
+        __handshake(el, fd, mqtt, AE_WRITABLE);
+        return;
     }
+#endif
+    aeDeleteTimeEvent(el, mqtt->conn.id);
+    mqtt->conn.on = 0;
+    if (__established(mqtt)) {
+        goto e1;
+    }
+    return;
+
+e1:
+    __connect_fail(mqtt);
 }
 
-static void
-__log(struct libmqtt *mqtt, const char *fmt, ...) {
-    int n;
-    va_list ap;
+static int
+__connect_timeout(aeEventLoop *el, long long id, void *privdata) {
+    struct libmqtt *mqtt;
+    (void)el;
+    (void)id;
 
-    if (!mqtt->log) return;
-    n = snprintf(mqtt->logbuf, LIBMQTT_LOG_BUFF, "Client %.*s ", mqtt->c.client_id.n, mqtt->c.client_id.s);
-    va_start(ap, fmt);
-    n += vsnprintf(mqtt->logbuf+n, LIBMQTT_LOG_BUFF-n, fmt, ap);
-    va_end(ap);
-    mqtt->logbuf[n] = '\0';
-    mqtt->log(mqtt->ud, mqtt->logbuf);
+    mqtt = (struct libmqtt *)privdata;
+    if (mqtt->local) {
+        __log(mqtt, "connect to %s timed out", mqtt->host);
+    } else {
+        __log(mqtt, "connect to %s:%d timed out", mqtt->host, mqtt->port);
+    }
+    mqtt->conn.on = 0;
+    __connect_fail(mqtt);
+    return AE_NOMORE;
 }
 
+/* socket options are best effort, a refused one is logged and skipped. */
 static void
-__check_retry(struct libmqtt *mqtt) {
-    struct libmqtt_pub **pp;
-
-    pp = &mqtt->pub.head;
-    while (*pp) {
-        struct libmqtt_pub *pub;
-        pub = *pp;
-        if (mqtt->t.now - pub->t > LIBMQTT_TIME_RETRY) {
-            switch (pub->s) {
-            case LIBMQTT_ST_SEND_PUBLUSH:
-            case LIBMQTT_ST_WAIT_PUBACK:
-            case LIBMQTT_ST_WAIT_PUBREC:
-                {
-                    struct mqtt_packet p;
-                    struct mqtt_b b;
-
-                    memset(&p, 0, sizeof p);
-                    p.h.type = PUBLISH;
-                    p.h.dup = 1;
-                    p.h.retain = pub->p.retain;
-                    p.h.qos = pub->p.qos;
-                    p.v.publish.packet_id = pub->p.packet_id;
-                    p.v.publish.topic_name.s = pub->p.topic;
-                    p.v.publish.topic_name.n = strlen(pub->p.topic);
-                    p.payload.s = pub->p.payload;
-                    p.payload.n = pub->p.length;
-
-                    if (mqtt__serialize(&p, &b)) {
-                        break;
-                    }
+__sockopt(struct libmqtt *mqtt, int fd) {
+    char err[ANET_ERR_LEN];
+    struct libmqtt_sockopt *so;
 
-                    if (0 == __write(mqtt, b.s, b.n)) {
-                        __log(mqtt, "sending PUBLISH (d%d, q%d, r%d, m%d, \'%s\', ...(%d bytes))",
-                              1, pub->p.qos, pub->p.retain, pub->p.packet_id, pub->p.topic, pub->p.length);
-                        if (pub->p.qos == MQTT_QOS_0) {
-                            *pp = (*pp)->next;
-                            free(pub->p.topic);
-                            if (pub->p.payload)
-                                free(pub->p.payload);
-                            free(pub);
-                            pub = 0;
-                            break;
-                        } else if (pub->p.qos == MQTT_QOS_1) {
-                            pub->s = LIBMQTT_ST_WAIT_PUBACK;
-                        } else {
-                            pub->s = LIBMQTT_ST_WAIT_PUBREC;
-                        }
-                    }
-                    pub->t = mqtt->t.now;
-                    mqtt_b_free(&b);
-                }
-                break;
-            case LIBMQTT_ST_SEND_PUBACK:
-                {
-                    char puback[] = MQTT_PUBACK(pub->p.packet_id);
-                    if (0 == __write(mqtt, puback, sizeof puback)) {
-                        __log(mqtt, "sending PUBACK (id: %"PRIu16")", pub->p.packet_id);
-                        *pp = (*pp)->next;
-                        free(pub->p.topic);
-                        if (pub->p.payload)
-                            free(pub->p.payload);
-                        free(pub);
-                        pub = 0;
-                    } else {
-                        pub->t = mqtt->t.now;
-                    }
-                }
-                break;
-            case LIBMQTT_ST_SEND_PUBREC:
-                {
-                    char pubrec[] = MQTT_PUBREC(pub->p.packet_id);
-                    if (0 == __write(mqtt, pubrec, sizeof pubrec)) {
-                        __log(mqtt, "sending PUBREC (id: %"PRIu16")", pub->p.packet_id);
-                        pub->s = LIBMQTT_ST_WAIT_PUBREL;
-                    }
-                    pub->t = mqtt->t.now;
-                }
-                break;
-            case LIBMQTT_ST_SEND_PUBREL:
-                {
-                    char pubrel[] = MQTT_PUBREL(pub->p.packet_id);
-                    if (0 == __write(mqtt, pubrel, sizeof pubrel)) {
-                        __log(mqtt, "sending PUBREL (id: %"PRIu16")", pub->p.packet_id);
-                        pub->s = LIBMQTT_ST_WAIT_PUBCOMP;
-                    }
-                    pub->t = mqtt->t.now;
-                }
-                break;
-            case LIBMQTT_ST_SEND_PUBCOMP:
-                {
-                    char pubcomp[] = MQTT_PUBCOMP(pub->p.packet_id);
-                    if (0 == __write(mqtt, pubcomp, sizeof pubcomp)) {
-                        __log(mqtt, "sending PUBCOMP (id: %"PRIu16")", pub->p.packet_id);
-                        *pp = (*pp)->next;
-                        free(pub->p.topic);
-                        if (pub->p.payload)
-                            free(pub->p.payload);
-                        free(pub);
-                        pub = 0;
-                    } else {
-                        pub->t = mqtt->t.now;
-                    }
-                }
-                break;
-            case LIBMQTT_ST_WAIT_PUBREL:
-                {
-                    char pubrec[] = MQTT_PUBREC(pub->p.packet_id);
-                    if (0 == __write(mqtt, pubrec, sizeof pubrec)) {
-                        __log(mqtt, "sending PUBREC (id: %"PRIu16")", pub->p.packet_id);
-                    }
-                    pub->t = mqtt->t.now;
-                }
-                break;
-            case LIBMQTT_ST_WAIT_PUBCOMP:
-                {
-                    char pubrel[] = MQTT_PUBREL(pub->p.packet_id);
-                    if (0 == __write(mqtt, pubrel, sizeof pubrel)) {
-                        __log(mqtt, "sending PUBREL (id: %"PRIu16")", pub->p.packet_id);
-                    }
-                    pub->t = mqtt->t.now;
-                }
-                break;
-            }
-        }
-        if (pub)
-            *pp = (*pp)->next;
+    so = &mqtt->so;
+    if (so->sndbuf > 0 && ANET_ERR == anetSetSendBuffer(err, fd, so->sndbuf)) {
+        __log(mqtt, "%s", err);
+    }
+    if (so->rcvbuf > 0 && ANET_ERR == anetSetRecvBuffer(err, fd, so->rcvbuf)) {
+        __log(mqtt, "%s", err);
+    }
+    if (mqtt->local) {
+        return;
+    }
+    if (ANET_ERR == (so->nagle ? anetDisableTcpNoDelay(err, fd) : anetEnableTcpNoDelay(err, fd))) {
+        __log(mqtt, "%s", err);
+    }
+    if (so->keepalive > 0 && ANET_ERR == anetKeepAlive(err, fd, so->keepalive)) {
+        __log(mqtt, "%s", err);
+    } else if (so->keepalive == 0 && ANET_ERR == anetTcpKeepAlive(err, fd)) {
+        __log(mqtt, "%s", err);
+    }
+    if (so->notsent_lowat > 0 && ANET_ERR == anetSetNotSentLowat(err, fd, so->notsent_lowat)) {
+        __log(mqtt, "%s", err);
     }
 }
 
+/* open a non-blocking socket to the broker, host is a path when local. */
 static int
-__update(aeEventLoop *el, long long id, void *privdata) {
-    struct libmqtt *mqtt;
-
-    mqtt = (struct libmqtt *)privdata;
-    mqtt->t.now += 1;
+__socket(struct libmqtt *mqtt) {
+    int fd;
 
-    if (mqtt->t.ping > 0 && (mqtt->t.now - mqtt->t.ping) > mqtt->c.keep_alive) {
-        if (mqtt->fd > 0) {
-            shutdown(mqtt->fd, SHUT_WR);
+    if (mqtt->local) {
+        /* unix sockets never report zerocopy completions. */
+        mqtt->zc.on = 0;
+        if (ANET_ERR != (fd = anetUnixNonBlockConnect(0, mqtt->host))) {
+            __sockopt(mqtt, fd);
         }
-        return 0;
-    }
-
-    if (mqtt->t.ping == 0 && (mqtt->t.now - mqtt->t.send) >= mqtt->c.keep_alive) {
-        char b[] = MQTT_PINGREQ;
-        if (0 == __write(mqtt, b, sizeof b)) {
-            mqtt->t.ping = mqtt->t.now;
-            __log(mqtt, "sending PINGREQ");
+        return fd;
+    }
+    if (__resolve(mqtt)) {
+        __log(mqtt, "resolve %s failed", mqtt->host);
+        return ANET_ERR;
+    }
+    if (ANET_ERR == (fd = anetTcpNonBlockConnect(0, mqtt->dns.ip, mqtt->port))) {
+        mqtt->dns.expire = 0;
+        return ANET_ERR;
+    }
+    __sockopt(mqtt, fd);
+    __zc_enable(mqtt, fd);
+#ifdef SO_BUSY_POLL
+    if (mqtt->spin.on) {
+        int usec = LIBMQTT_BUSY_POLL;
+        if (-1 == setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof usec)) {
+            __log(mqtt, "SO_BUSY_POLL: %s", strerror(errno));
         }
     }
-    __check_retry(mqtt);
-    return 1000;
+#endif
+    return fd;
 }
 
+/* start a non-blocking connect, output written meanwhile is queued. */
 static int
 __connect(struct libmqtt *mqtt) {
     int fd;
     long long id;
 
-    if (ANET_ERR == (fd = anetTcpConnect(0, mqtt->host, mqtt->port))) {
+    if (ANET_ERR == (fd = __socket(mqtt))) {
         goto e1;
     }
-    anetNonBlock(0, fd);
-    anetEnableTcpNoDelay(0, fd);
-    anetTcpKeepAlive(0, fd);
-    if (AE_ERR == aeCreateFileEvent(mqtt->el, fd, AE_READABLE, __read, mqtt)) {
+    if (AE_ERR == aeCreateFileEvent(mqtt->el, fd, AE_WRITABLE, __connected, mqtt)) {
         goto e2;
     }
-    if (mqtt->c.keep_alive > 0) {
-        if (AE_ERR == (id = aeCreateTimeEvent(mqtt->el, 1000, __update, mqtt, 0))) {
-            goto e3;
-        }
-        mqtt->id = id;
+    if (AE_ERR == (id = aeCreateTimeEvent(mqtt->el, mqtt->conn.timeout, __connect_timeout, mqtt, 0))) {
+        goto e3;
     }
+    mqtt->conn.id = id;
+    mqtt->conn.on = 1;
     mqtt->fd = fd;
     return 0;
 
 e3:
-    aeDeleteFileEvent(mqtt->el, fd, AE_READABLE);
+    aeDeleteFileEvent(mqtt->el, fd, AE_WRITABLE);
 e2:
     close(fd);
 e1:
     return -1;
 }
 
+/* CONNECT opens every connection, reconnects included. */
+static int
+__send_connect(struct libmqtt *mqtt) {
+    struct mqtt_packet p;
+    struct mqtt_b b;
+
+    memset(&p, 0, sizeof p);
+    p.h.type = CONNECT;
+    p.v.connect = mqtt->c;
+    p.v.connect.proto_name.s = (char *)MQTT_PROTOCOL_NAMES[mqtt->c.proto_ver];
+    p.v.connect.proto_name.n = strlen(p.v.connect.proto_name.s);
+
+    if (__serialize(mqtt, &p, &b)) {
+        return LIBMQTT_ERROR_MALLOC;
+    }
+    /* CONNECT never waits in the batch, the broker answers nothing else
+     * before it. */
+    if (__write(mqtt, b.s, b.n) || __flush(mqtt)) {
+        return LIBMQTT_ERROR_WRITE;
+    }
+    __log(mqtt, "sending CONNECT (%s, c%d, k%d, u\'%.*s\', p\'%.*s\')", MQTT_PROTOCOL_NAMES[mqtt->c.proto_ver],
+          mqtt->c.clean_sess, mqtt->c.keep_alive, mqtt->c.username.n, mqtt->c.username.s,
+          mqtt->c.password.n, mqtt->c.password.s);
+    return LIBMQTT_SUCCESS;
+}
+
 static void
 __generate_client_id(struct mqtt_b *b) {
     char id[1024] = {0};
@@ -370,6 +1651,8 @@ const char *libmqtt__strerror(int rc) {
         "tcp connection error",
         "tcp write error",
         "max topic/qos per subscribe or unsubscribe",
+        "tls error",
+        "required callback not set",
     };
 
     if (-rc <= 0 || -rc > sizeof(__libmqtt_error_strings)/sizeof(char *))
@@ -377,11 +1660,47 @@ const char *libmqtt__strerror(int rc) {
     return __libmqtt_error_strings[-rc];
 }
 
+static uint32_t
+__pub_hash(uint16_t packet_id, enum libmqtt_dir d) {
+    return ((uint32_t)packet_id << 1) | d;
+}
+
+/* double the hash table, chains are relinked into the new slots. */
+static int
+__pub_grow(struct libmqtt *mqtt) {
+    struct libmqtt_pub **slot, *pub, *next;
+    int i, size;
+    uint32_t h;
+
+    size = mqtt->pub.size ? mqtt->pub.size * 2 : LIBMQTT_PUB_SLOTS;
+    slot = (struct libmqtt_pub **)calloc(size, sizeof *slot);
+    if (!slot) {
+        return -1;
+    }
+    for (i = 0; i < mqtt->pub.size; i++) {
+        for (pub = mqtt->pub.slot[i]; pub; pub = next) {
+            next = pub->hnext;
+            h = __pub_hash(pub->p.packet_id, pub->d) & (size - 1);
+            pub->hnext = slot[h];
+            slot[h] = pub;
+        }
+    }
+    free(mqtt->pub.slot);
+    mqtt->pub.slot = slot;
+    mqtt->pub.size = size;
+    return 0;
+}
+
 static int
 __insert_pub(struct libmqtt *mqtt, struct mqtt_packet *p, enum libmqtt_dir d,
              enum libmqtt_state s) {
     struct libmqtt_pub *pub;
+    uint32_t h;
 
+    /* keep at most one publish per slot, up to one slot per key. */
+    if (mqtt->pub.count >= mqtt->pub.size && mqtt->pub.size < LIBMQTT_PUB_MAX && __pub_grow(mqtt)) {
+        return -1;
+    }
     pub = (struct libmqtt_pub *)malloc(sizeof *pub);
     if (!pub) goto e;
     memset(pub, 0, sizeof *pub);
@@ -400,12 +1719,17 @@ __insert_pub(struct libmqtt *mqtt, struct mqtt_packet *p, enum libmqtt_dir d,
     pub->s = s;
     pub->t = mqtt->t.now;
 
-    if (!mqtt->pub.head) {
-        mqtt->pub.head = mqtt->pub.tail = pub;
-    } else {
+    h = __pub_hash(pub->p.packet_id, d) & (mqtt->pub.size - 1);
+    pub->hnext = mqtt->pub.slot[h];
+    mqtt->pub.slot[h] = pub;
+    pub->prev = mqtt->pub.tail;
+    if (mqtt->pub.tail) {
         mqtt->pub.tail->next = pub;
-        mqtt->pub.tail = pub;
+    } else {
+        mqtt->pub.head = pub;
     }
+    mqtt->pub.tail = pub;
+    mqtt->pub.count++;
 
     return 0;
 
@@ -424,18 +1748,23 @@ static void
 __delete_pub(struct libmqtt *mqtt, struct libmqtt_pub *pub) {
     struct libmqtt_pub **pp;
 
-    pp = &mqtt->pub.head;
-    while (*pp) {
-        if (*pp == pub) {
-            *pp = (*pp)->next;
-            free(pub->p.topic);
-            if (pub->p.payload)
-                free(pub->p.payload);
-            free(pub);
-        } else {
-            pp = &(*pp)->next;
-        }
+    pp = &mqtt->pub.slot[__pub_hash(pub->p.packet_id, pub->d) & (mqtt->pub.size - 1)];
+    while (*pp != pub) {
+        pp = &(*pp)->hnext;
+    }
+    *pp = pub->hnext;
+    if (pub->prev) {
+        pub->prev->next = pub->next;
+    } else {
+        mqtt->pub.head = pub->next;
+    }
+    if (pub->next) {
+        pub->next->prev = pub->prev;
+    } else {
+        mqtt->pub.tail = pub->prev;
     }
+    mqtt->pub.count--;
+    __free_pub(pub);
 }
 
 static void
@@ -449,12 +1778,15 @@ __find_pub(struct libmqtt *mqtt, uint16_t packet_id, enum libmqtt_dir d,
            enum libmqtt_state s) {
     struct libmqtt_pub *pub;
 
-    pub = mqtt->pub.head;
+    if (!mqtt->pub.size) {
+        return 0;
+    }
+    pub = mqtt->pub.slot[__pub_hash(packet_id, d) & (mqtt->pub.size - 1)];
     while (pub) {
         if (pub->p.packet_id == packet_id && pub->d == d && pub->s == s) {
             return pub;
         }
-        pub = pub->next;
+        pub = pub->hnext;
     }
 
     return 0;
@@ -465,7 +1797,16 @@ __on_connack(void *ud, struct mqtt_packet *p) {
     struct libmqtt *mqtt;
 
     mqtt = (struct libmqtt *)ud;
+    __lat_record(mqtt);
     __log(mqtt, "received CONNACK (a%d, c%d)", p->v.connack.ack_flags, p->v.connack.return_code);
+    if (p->v.connack.return_code == CONNACK_ACCEPTED) {
+        mqtt->reconn.up = 1;
+        if (mqtt->reconn.attempt > 0) {
+            __reconnect_report(mqtt, LIBMQTT_SUCCESS);
+            mqtt->reconn.attempt = 0;
+        }
+        mqtt->reconn.delay = mqtt->reconn.base;
+    }
     if (mqtt->cb.connack)
         mqtt->cb.connack(mqtt, mqtt->ud, p->v.connack.ack_flags, p->v.connack.return_code);
     return 0;
@@ -477,6 +1818,7 @@ __on_suback(void *ud, struct mqtt_packet *p) {
     int i;
 
     mqtt = (struct libmqtt *)ud;
+    __lat_record(mqtt);
     for (i = 0; i < p->v.suback.n; i++) {
         __log(mqtt, "received SUBACK (id: %"PRIu16", QoS: %d)", p->v.suback.packet_id, p->v.suback.qos[i]);
     }
@@ -490,6 +1832,7 @@ __on_unsuback(void *ud, struct mqtt_packet *p) {
     struct libmqtt *mqtt;
 
     mqtt = (struct libmqtt *)ud;
+    __lat_record(mqtt);
     __log(mqtt, "received UNSUBACK (id: %"PRIu16")", p->v.unsuback.packet_id);
     if (mqtt->cb.unsuback)
         mqtt->cb.unsuback(mqtt, mqtt->ud, p->v.unsuback.packet_id);
@@ -506,6 +1849,7 @@ __on_publish(void *ud, struct mqtt_packet *p) {
     strncpy(topic, p->v.publish.topic_name.s, p->v.publish.topic_name.n);
     topic[p->v.publish.topic_name.n] = '\0';
     mqtt = (struct libmqtt *)ud;
+    __lat_record(mqtt);
     __log(mqtt, "received PUBLISH (d%d, q%d, r%d, m%d, \'%s\', ...(%d bytes))",
           p->h.dup, p->h.qos, p->h.retain, p->v.publish.packet_id, topic, p->payload.n);
     switch (p->h.qos) {
@@ -533,6 +1877,54 @@ __on_publish(void *ud, struct mqtt_packet *p) {
     return 0;
 }
 
+static int
+__on_publish_chunk(void *ud, struct mqtt_packet *p, struct mqtt_b *chunk, int offset) {
+    struct libmqtt *mqtt;
+    char puback[] = MQTT_PUBACK(p->v.publish.packet_id);
+    char pubrec[] = MQTT_PUBREC(p->v.publish.packet_id);
+    char topic[p->v.publish.topic_name.n+1];
+
+    strncpy(topic, p->v.publish.topic_name.s, p->v.publish.topic_name.n);
+    topic[p->v.publish.topic_name.n] = '\0';
+    mqtt = (struct libmqtt *)ud;
+    __lat_record(mqtt);
+    if (offset == 0 && chunk->n == 0) {
+        __log(mqtt, "received PUBLISH (d%d, q%d, r%d, m%d, \'%s\', ...(%d bytes, streamed))",
+              p->h.dup, p->h.qos, p->h.retain, p->v.publish.packet_id, topic, p->payload.n);
+    }
+    if (mqtt->cb.publish_chunk)
+        mqtt->cb.publish_chunk(mqtt, mqtt->ud, topic, p->h.qos, p->h.retain, chunk->s, chunk->n, offset, p->payload.n);
+    if (offset + chunk->n < p->payload.n) {
+        return 0;
+    }
+    p->payload.s = 0;
+    p->payload.n = 0;
+    switch (p->h.qos) {
+        case MQTT_QOS_0:
+            return 0;
+        case MQTT_QOS_1:
+            if (__write(mqtt, puback, sizeof puback)) {
+                return __insert_pub(mqtt, p, LIBMQTT_DIR_IN, LIBMQTT_ST_SEND_PUBACK);
+            }
+            __log(mqtt, "sending PUBACK (id: %"PRIu16")", p->v.publish.packet_id);
+            return 0;
+        case MQTT_QOS_2:
+            if (__write(mqtt, pubrec, sizeof pubrec)) {
+                if (__insert_pub(mqtt, p, LIBMQTT_DIR_IN, LIBMQTT_ST_SEND_PUBREC))
+                    return -1;
+            } else {
+                __log(mqtt, "sending PUBREC (id: %"PRIu16")", p->v.publish.packet_id);
+                if (__insert_pub(mqtt, p, LIBMQTT_DIR_IN, LIBMQTT_ST_WAIT_PUBREL))
+                    return -1;
+            }
+            mqtt->pub.tail->delivered = 1;
+            return 0;
+        case MQTT_QOS_F:
+            return -1;
+    }
+    return 0;
+}
+
 static int
 __on_puback(void *ud, struct mqtt_packet *p) {
     struct libmqtt *mqtt;
@@ -540,6 +1932,7 @@ __on_puback(void *ud, struct mqtt_packet *p) {
     uint16_t packet_id = p->v.puback.packet_id;
 
     mqtt = (struct libmqtt *)ud;
+    __lat_record(mqtt);
     __log(mqtt, "received PUBACK (id: %"PRIu16")", packet_id);
     pub = __find_pub(mqtt, packet_id, LIBMQTT_DIR_OUT, LIBMQTT_ST_WAIT_PUBACK);
     if (pub) {
@@ -558,6 +1951,7 @@ __on_pubrec(void *ud, struct mqtt_packet *p) {
     uint16_t packet_id = p->v.pubrec.packet_id;
 
     mqtt = (struct libmqtt *)ud;
+    __lat_record(mqtt);
     __log(mqtt, "received PUBREC (id: %"PRIu16")", packet_id);
     pub = __find_pub(mqtt, packet_id, LIBMQTT_DIR_OUT, LIBMQTT_ST_WAIT_PUBREC);
     if (pub) {
@@ -580,11 +1974,12 @@ __on_pubrel(void *ud, struct mqtt_packet *p) {
     uint16_t packet_id = p->v.pubrel.packet_id;
 
     mqtt = (struct libmqtt *)ud;
+    __lat_record(mqtt);
     __log(mqtt, "received PUBREL (id: %"PRIu16")", packet_id);
     pub = __find_pub(mqtt, packet_id, LIBMQTT_DIR_IN, LIBMQTT_ST_WAIT_PUBREL);
     if (pub) {
         char pubcomp[] = MQTT_PUBCOMP(packet_id);
-        if (mqtt->cb.publish)
+        if (mqtt->cb.publish && !pub->delivered)
             mqtt->cb.publish(mqtt, mqtt->ud, pub->p.topic, pub->p.qos, pub->p.retain, pub->p.payload, pub->p.length);
         if (__write(mqtt, pubcomp, sizeof pubcomp)) {
             __update_pub(mqtt, pub, LIBMQTT_ST_SEND_PUBCOMP);
@@ -604,6 +1999,7 @@ __on_pubcomp(void *ud, struct mqtt_packet *p) {
     uint16_t packet_id = p->v.pubcomp.packet_id;
 
     mqtt = (struct libmqtt *)ud;
+    __lat_record(mqtt);
     __log(mqtt, "received PUBCOMP (id: %"PRIu16")", packet_id);
     pub = __find_pub(mqtt, packet_id, LIBMQTT_DIR_OUT, LIBMQTT_ST_WAIT_PUBCOMP);
     if (pub) {
@@ -621,6 +2017,7 @@ __on_pingresp(void *ud, struct mqtt_packet *p) {
     (void)p;
 
     mqtt = (struct libmqtt *)ud;
+    __lat_record(mqtt);
     __log(mqtt, "received PINGRESP");
     mqtt->t.ping = 0;
     return 0;
@@ -656,7 +2053,16 @@ int libmqtt__create(struct libmqtt **mqtt, const char *client_id, void *ud, stru
         goto e3;
     }
 
+    (*mqtt)->rd.s = malloc(LIBMQTT_READ_BUFF);
+    if (!(*mqtt)->rd.s) {
+        rc = LIBMQTT_ERROR_MALLOC;
+        goto e4;
+    }
+    (*mqtt)->rd.size = LIBMQTT_READ_BUFF;
+    (*mqtt)->rd.max = LIBMQTT_READ_MAX;
+
     mqtt__parse_init(&(*mqtt)->p);
+    mqtt__batch_init(&(*mqtt)->batch.b);
     mqtt__parse_cb(&(*mqtt)->p, CONNACK, __on_connack);
     mqtt__parse_cb(&(*mqtt)->p, SUBACK, __on_suback);
     mqtt__parse_cb(&(*mqtt)->p, UNSUBACK, __on_unsuback);
@@ -670,14 +2076,29 @@ int libmqtt__create(struct libmqtt **mqtt, const char *client_id, void *ud, stru
     (*mqtt)->ud = ud;
     (*mqtt)->cb = *cb;
     (*mqtt)->el = el;
+    el->privdata = *mqtt;
+    aeSetBeforeSleepProc(el, __before_sleep);
+    aeSetAfterSleepProc(el, __after_sleep);
     (*mqtt)->t.ping = 0;
     (*mqtt)->t.send = 0;
     (*mqtt)->c.keep_alive = LIBMQTT_DEF_KEEPALIVE;
     (*mqtt)->c.clean_sess = 1;
     (*mqtt)->c.proto_ver = MQTT_PROTO_V4;
+    (*mqtt)->wq.low = LIBMQTT_DEF_LOW_WATER;
+    (*mqtt)->wq.high = LIBMQTT_DEF_HIGH_WATER;
+    (*mqtt)->conn.timeout = LIBMQTT_DEF_CONNECT_TIMEOUT;
+    (*mqtt)->dns.ttl = LIBMQTT_DEF_DNS_TTL;
+    (*mqtt)->reconn.base = LIBMQTT_DEF_RECONNECT_BASE;
+    (*mqtt)->reconn.max = LIBMQTT_DEF_RECONNECT_MAX;
+    (*mqtt)->reconn.id = -1;
+    (*mqtt)->reconn.seed = (uint32_t)(__nstime() ^ ((long long)getpid() << 16) ^ (uintptr_t)*mqtt) | 1;
+    (*mqtt)->spin.cpu = -1;
+    (*mqtt)->id = -1;
 
     return LIBMQTT_SUCCESS;
 
+e4:
+    mqtt_b_free(&(*mqtt)->c.client_id);
 e3:
     free(*mqtt);
 e2:
@@ -692,11 +2113,48 @@ int libmqtt__destroy(struct libmqtt *mqtt) {
     }
     aeDeleteEventLoop(mqtt->el);
 
+    mqtt__parse_free(&mqtt->p);
+    free(mqtt->out.s);
+    mqtt__batch_free(&mqtt->batch.b);
+    free(mqtt->wq.s);
+    free(mqtt->rd.s);
+    /* pinned payloads pass to their zerocopy record, released below. */
+    while (mqtt->pub.head) {
+        __delete_pub(mqtt, mqtt->pub.head);
+    }
+    free(mqtt->pub.slot);
+    if (mqtt->fd > 0) {
+        __zc_reap(mqtt, mqtt->fd, &mqtt->zc.head, &mqtt->zc.tail);
+    }
+    __zc_forget(mqtt->zc.head);
+    __zc_linger_reap(mqtt);
+    while (mqtt->zc.linger) {
+        struct libmqtt_linger *l;
+        l = mqtt->zc.linger;
+        mqtt->zc.linger = l->next;
+        __zc_forget(l->head);
+        close(l->fd);
+        free(l);
+    }
+    free(mqtt->zc.spare);
+    while (mqtt->topics) {
+        struct libmqtt_topic *t;
+        t = mqtt->topics;
+        mqtt->topics = t->next;
+        mqtt__template_free(&t->t);
+        mqtt_b_free(&t->topic);
+        free(t);
+    }
     mqtt_b_free(&mqtt->c.client_id);
     mqtt_b_free(&mqtt->c.username);
     mqtt_b_free(&mqtt->c.password);
     mqtt_b_free(&mqtt->c.will_topic);
     mqtt_b_free(&mqtt->c.will_payload);
+#ifdef HAVE_OPENSSL
+    SSL_free(mqtt->tls.ssl);
+    SSL_SESSION_free(mqtt->tls.sess);
+    SSL_CTX_free(mqtt->tls.ctx);
+#endif
     free(mqtt->host);
     free(mqtt);
     return LIBMQTT_SUCCESS;
@@ -741,12 +2199,45 @@ int libmqtt__auth(struct libmqtt *mqtt, const char *username, const char *passwo
             return LIBMQTT_ERROR_MALLOC;
         }
     }
-    if (password) {
-        mqtt_b_dup(&mqtt->c.password, password);
-        if (mqtt_b_empty(&mqtt->c.username)) {
-            return LIBMQTT_ERROR_MALLOC;
-        }
+    if (password) {
+        mqtt_b_dup(&mqtt->c.password, password);
+        if (mqtt_b_empty(&mqtt->c.username)) {
+            return LIBMQTT_ERROR_MALLOC;
+        }
+    }
+    return LIBMQTT_SUCCESS;
+}
+
+int libmqtt__max_packet(struct libmqtt *mqtt, int size) {
+    if (!mqtt) {
+        return LIBMQTT_ERROR_NULL;
+    }
+    mqtt__parse_max(&mqtt->p, size);
+    return LIBMQTT_SUCCESS;
+}
+
+/* payloads above threshold go to the publish_chunk callback only, a
+ * threshold <= 0 turns streaming off. */
+int libmqtt__stream(struct libmqtt *mqtt, int threshold) {
+    if (!mqtt) {
+        return LIBMQTT_ERROR_NULL;
+    }
+    if (threshold <= 0) {
+        mqtt__parse_stream(&mqtt->p, 0, 0);
+        return LIBMQTT_SUCCESS;
+    }
+    if (!mqtt->cb.publish_chunk) {
+        return LIBMQTT_ERROR_CALLBACK;
+    }
+    mqtt__parse_stream(&mqtt->p, threshold, __on_publish_chunk);
+    return LIBMQTT_SUCCESS;
+}
+
+int libmqtt__strict(struct libmqtt *mqtt, int strict) {
+    if (!mqtt) {
+        return LIBMQTT_ERROR_NULL;
     }
+    mqtt__parse_strict(&mqtt->p, strict);
     return LIBMQTT_SUCCESS;
 }
 
@@ -770,67 +2261,112 @@ int libmqtt__will(struct libmqtt *mqtt, int retain, enum mqtt_qos qos, const cha
     return LIBMQTT_SUCCESS;
 }
 
-int libmqtt__connect(struct libmqtt *mqtt, const char *host, int port) {
-    struct mqtt_packet p;
-    struct mqtt_b b;
-    int rc;
+/* connections use tls from now on, a NULL ca_file uses the system store. */
+int libmqtt__tls(struct libmqtt *mqtt, const char *ca_file, const char *cert_file, const char *key_file, int verify) {
+#ifdef HAVE_OPENSSL
+    SSL_CTX *ctx;
 
     if (!mqtt) {
         return LIBMQTT_ERROR_NULL;
     }
-    mqtt->host = strdup(host);
-    mqtt->port = port;
-    if (!mqtt->host) {
-        return LIBMQTT_ERROR_MALLOC;
+    if (!(ctx = SSL_CTX_new(TLS_client_method()))) {
+        goto e1;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, __tls_new_session);
+    SSL_CTX_set_verify(ctx, verify ? SSL_VERIFY_PEER : SSL_VERIFY_NONE, 0);
+    if (ca_file ? !SSL_CTX_load_verify_locations(ctx, ca_file, 0) : !SSL_CTX_set_default_verify_paths(ctx)) {
+        goto e2;
+    }
+    if (cert_file && !SSL_CTX_use_certificate_chain_file(ctx, cert_file)) {
+        goto e2;
+    }
+    if (key_file && !SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM)) {
+        goto e2;
     }
+    SSL_SESSION_free(mqtt->tls.sess);
+    mqtt->tls.sess = 0;
+    SSL_CTX_free(mqtt->tls.ctx);
+    mqtt->tls.ctx = ctx;
+    return LIBMQTT_SUCCESS;
 
-    memset(&p, 0, sizeof p);
-    p.h.type = CONNECT;
-    p.v.connect = mqtt->c;
-    p.v.connect.proto_name.s = (char *)MQTT_PROTOCOL_NAMES[mqtt->c.proto_ver];
-    p.v.connect.proto_name.n = strlen(p.v.connect.proto_name.s);
+e2:
+    SSL_CTX_free(ctx);
+e1:
+    __tls_log(mqtt, "tls");
+    return LIBMQTT_ERROR_TLS;
+#else
+    (void)ca_file;
+    (void)cert_file;
+    (void)key_file;
+    (void)verify;
+    if (!mqtt) {
+        return LIBMQTT_ERROR_NULL;
+    }
+    __log(mqtt, "tls: not built with openssl");
+    return LIBMQTT_ERROR_TLS;
+#endif
+}
 
-    if (mqtt__serialize(&p, &b)) {
+static int
+__open(struct libmqtt *mqtt, const char *host, int port, int local) {
+    free(mqtt->host);
+    mqtt->host = strdup(host);
+    mqtt->port = port;
+    mqtt->local = local;
+    if (!mqtt->host) {
         return LIBMQTT_ERROR_MALLOC;
     }
+    mqtt->dns.ip[0] = '\0';
+    mqtt->disconnect = 0;
+    mqtt->reconn.attempt = 0;
 
     if (__connect(mqtt)) {
-        mqtt_b_free(&b);
         return LIBMQTT_ERROR_CONNECT;
     }
-    rc = __write(mqtt, b.s, b.n);
-    mqtt_b_free(&b);
-    if (rc) {
-        return LIBMQTT_ERROR_WRITE;
+    return __send_connect(mqtt);
+}
+
+int libmqtt__connect(struct libmqtt *mqtt, const char *host, int port) {
+    if (!mqtt) {
+        return LIBMQTT_ERROR_NULL;
     }
-    __log(mqtt, "sending CONNECT (%s, c%d, k%d, u\'%.*s\', p\'%.*s\')", MQTT_PROTOCOL_NAMES[mqtt->c.proto_ver],
-          mqtt->c.clean_sess, mqtt->c.keep_alive, mqtt->c.username.n, mqtt->c.username.s,
-          mqtt->c.password.n, mqtt->c.password.s);
-    return LIBMQTT_SUCCESS;
+    return __open(mqtt, host, port, 0);
+}
+
+int libmqtt__connect_unix(struct libmqtt *mqtt, const char *path) {
+    if (!mqtt) {
+        return LIBMQTT_ERROR_NULL;
+    }
+    return __open(mqtt, path, 0, 1);
 }
 
 int libmqtt__subscribe(struct libmqtt *mqtt, uint16_t *id, int count, const char *topic[], enum mqtt_qos qos[]) {
     struct mqtt_packet p;
     struct mqtt_b b;
+    struct mqtt_b topic_name[MQTT_MAX_SUB];
     int rc, i;
 
     if (!mqtt) {
         return LIBMQTT_ERROR_NULL;
     }
-    if (count > MQTT_MAX_SUB) {
+    if (count < 1 || count > MQTT_MAX_SUB) {
         return LIBMQTT_ERROR_MAXSUB;
     }
+
     memset(&p, 0, sizeof p);
     p.h.type = SUBSCRIBE;
     p.v.subscribe.packet_id = __generate_packet_id(mqtt);
     for (i = 0; i < count; i++) {
-        p.v.subscribe.topic_name[i].s = (char *)topic[i];
-        p.v.subscribe.topic_name[i].n = strlen(topic[i]);
-        p.v.subscribe.qos[i] = qos[i];
+        topic_name[i].s = (char *)topic[i];
+        topic_name[i].n = strlen(topic[i]);
     }
+    p.v.subscribe.topic_name = topic_name;
+    p.v.subscribe.qos = qos;
     p.v.subscribe.n = count;
 
-    if (mqtt__serialize(&p, &b)) {
+    if (__serialize(mqtt, &p, &b)) {
         return LIBMQTT_ERROR_MALLOC;
     }
 
@@ -838,7 +2374,6 @@ int libmqtt__subscribe(struct libmqtt *mqtt, uint16_t *id, int count, const char
         *id = p.v.subscribe.packet_id;
     }
     rc = __write(mqtt, b.s, b.n);
-    mqtt_b_free(&b);
     if (rc) {
         return LIBMQTT_ERROR_WRITE;
     }
@@ -852,24 +2387,27 @@ int libmqtt__subscribe(struct libmqtt *mqtt, uint16_t *id, int count, const char
 int libmqtt__unsubscribe(struct libmqtt *mqtt, uint16_t *id, int count, const char *topic[]) {
     struct mqtt_packet p;
     struct mqtt_b b;
+    struct mqtt_b topic_name[MQTT_MAX_SUB];
     int rc, i;
 
     if (!mqtt) {
         return LIBMQTT_ERROR_NULL;
     }
-    if (count > MQTT_MAX_SUB) {
+    if (count < 1 || count > MQTT_MAX_SUB) {
         return LIBMQTT_ERROR_MAXSUB;
     }
+
     memset(&p, 0, sizeof p);
     p.h.type = UNSUBSCRIBE;
     p.v.unsubscribe.packet_id = __generate_packet_id(mqtt);
     for (i = 0; i < count; i++) {
-        p.v.unsubscribe.topic_name[i].s = (char *)topic[i];
-        p.v.unsubscribe.topic_name[i].n = strlen(topic[i]);
+        topic_name[i].s = (char *)topic[i];
+        topic_name[i].n = strlen(topic[i]);
     }
+    p.v.unsubscribe.topic_name = topic_name;
     p.v.unsubscribe.n = count;
 
-    if (mqtt__serialize(&p, &b)) {
+    if (__serialize(mqtt, &p, &b)) {
         return LIBMQTT_ERROR_MALLOC;
     }
 
@@ -877,7 +2415,6 @@ int libmqtt__unsubscribe(struct libmqtt *mqtt, uint16_t *id, int count, const ch
         *id = p.v.unsubscribe.packet_id;
     }
     rc = __write(mqtt, b.s, b.n);
-    mqtt_b_free(&b);
     if (rc) {
         return LIBMQTT_ERROR_WRITE;
     }
@@ -888,12 +2425,128 @@ int libmqtt__unsubscribe(struct libmqtt *mqtt, uint16_t *id, int count, const ch
     return LIBMQTT_SUCCESS;
 }
 
+static void
+__log_publish(struct libmqtt *mqtt, struct mqtt_packet *p) {
+    __log(mqtt, "sending PUBLISH (d%d, q%d, r%d, m%d, \'%.*s\', ...(%d bytes))",
+          0, p->h.qos, p->h.retain, p->v.publish.packet_id,
+          p->v.publish.topic_name.n, p->v.publish.topic_name.s, p->payload.n);
+}
+
+/* log a sent PUBLISH and track it until acknowledged, or queue it for
+ * retry if the write failed. */
+static int
+__published(struct libmqtt *mqtt, struct mqtt_packet *p, int rc) {
+    enum libmqtt_state s;
+
+    if (!rc) {
+        __log_publish(mqtt, p);
+    }
+    if (!rc && p->h.qos == MQTT_QOS_0) {
+        return LIBMQTT_SUCCESS;
+    }
+    if (rc) {
+        s = LIBMQTT_ST_SEND_PUBLUSH;
+    } else if (p->h.qos == MQTT_QOS_1) {
+        s = LIBMQTT_ST_WAIT_PUBACK;
+    } else if (p->h.qos == MQTT_QOS_2) {
+        s = LIBMQTT_ST_WAIT_PUBREC;
+    } else {
+        return LIBMQTT_ERROR_QOS;
+    }
+    if (__insert_pub(mqtt, p, LIBMQTT_DIR_OUT, s)) {
+        return LIBMQTT_ERROR_MALLOC;
+    }
+    return LIBMQTT_SUCCESS;
+}
+
+#ifdef LIBMQTT_ZEROCOPY
+/* large QoS 1/2 payloads are copied into the in-flight record anyway, send
+ * that copy with MSG_ZEROCOPY and keep it pinned until the kernel is done. */
+static int
+__zerocopy(struct libmqtt *mqtt, struct mqtt_packet *p, int count) {
+    return mqtt->zc.on && mqtt->zc.threshold > 0 && count == 2
+        && p->h.qos > MQTT_QOS_0 && p->payload.n >= mqtt->zc.threshold
+        && mqtt->fd > 0 && !mqtt->conn.on && mqtt->wq.n == 0
+        && !mqtt->batch.on && !mqtt->batch.cork && mqtt->batch.b.n == 0;
+}
+
+static int
+__publish_zc(struct libmqtt *mqtt, struct mqtt_packet *p, struct iovec iov[2]) {
+    struct libmqtt_pub *pub;
+    struct libmqtt_zc *zc;
+    struct iovec rest;
+    int nwrite;
+
+    if (__insert_pub(mqtt, p, LIBMQTT_DIR_OUT,
+                     p->h.qos == MQTT_QOS_1 ? LIBMQTT_ST_WAIT_PUBACK : LIBMQTT_ST_WAIT_PUBREC)) {
+        return LIBMQTT_ERROR_MALLOC;
+    }
+    pub = mqtt->pub.tail;
+    if (!(zc = malloc(sizeof *zc))) {
+        goto e1;
+    }
+    if (!mqtt->zc.spare && !(mqtt->zc.spare = malloc(sizeof *mqtt->zc.spare))) {
+        free(zc);
+        goto e1;
+    }
+    if (__send(mqtt, iov, 1)) {
+        goto e3;
+    }
+    nwrite = 0;
+    if (mqtt->wq.n == 0) {
+        do {
+            nwrite = send(mqtt->fd, pub->p.payload, pub->p.length, MSG_ZEROCOPY);
+        } while (nwrite == -1 && errno == EINTR);
+        if (nwrite == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS) {
+                goto e3;
+            }
+            nwrite = 0;
+        }
+    }
+    if (nwrite > 0) {
+        zc->seq = mqtt->zc.seq++;
+        zc->buf = pub->p.payload;
+        zc->pub = pub;
+        zc->next = 0;
+        if (mqtt->zc.tail) {
+            mqtt->zc.tail->next = zc;
+        } else {
+            mqtt->zc.head = zc;
+        }
+        mqtt->zc.tail = zc;
+        pub->zc = zc;
+    } else {
+        free(zc);
+    }
+    /* whatever the socket did not take is copied to the output ring. */
+    if (nwrite < pub->p.length) {
+        rest.iov_base = pub->p.payload + nwrite;
+        rest.iov_len = pub->p.length - nwrite;
+        if (__send(mqtt, &rest, 1)) {
+            goto e2;
+        }
+    }
+    __log_publish(mqtt, p);
+    return LIBMQTT_SUCCESS;
+
+e3:
+    free(zc);
+e2:
+    /* part of the packet may be on the wire, the stream cannot go on. */
+    __close(mqtt);
+    __lost(mqtt);
+e1:
+    pub->s = LIBMQTT_ST_SEND_PUBLUSH;
+    return LIBMQTT_SUCCESS;
+}
+#endif
+
 int libmqtt__publish(struct libmqtt *mqtt, uint16_t *id, const char *topic,
                      enum mqtt_qos qos, int retain, const char *payload, int length) {
     struct mqtt_packet p;
-    struct mqtt_b b;
-    enum libmqtt_state s;
-    int rc;
+    struct iovec iov[2];
+    int rc, count;
 
     if (!mqtt) {
         return LIBMQTT_ERROR_NULL;
@@ -914,34 +2567,186 @@ int libmqtt__publish(struct libmqtt *mqtt, uint16_t *id, const char *topic,
     p.payload.s = (char *)payload;
     p.payload.n = length;
 
-    if (mqtt__serialize(&p, &b)) {
+    if (-1 == (count = __serialize_iov(mqtt, &p, iov))) {
         return LIBMQTT_ERROR_MALLOC;
     }
 
     if (qos > MQTT_QOS_0 && id) {
         *id = p.v.publish.packet_id;
     }
-    rc = __write(mqtt, b.s, b.n);
-    mqtt_b_free(&b);
-    if (!rc) {
-        __log(mqtt, "sending PUBLISH (d%d, q%d, r%d, m%d, \'%s\', ...(%d bytes))",
-              0, qos, retain, p.v.publish.packet_id, topic, length);
+#ifdef LIBMQTT_ZEROCOPY
+    if (__zerocopy(mqtt, &p, count)) {
+        return __publish_zc(mqtt, &p, iov);
     }
-    if (!rc && qos == MQTT_QOS_0) {
-        return LIBMQTT_SUCCESS;
+#endif
+    rc = __writev(mqtt, iov, count);
+    return __published(mqtt, &p, rc);
+}
+
+int libmqtt__topic(struct libmqtt *mqtt, struct libmqtt_topic **t, const char *topic,
+                   enum mqtt_qos qos, int retain) {
+    struct libmqtt_topic *tp;
+
+    if (!mqtt || !t || !topic) {
+        return LIBMQTT_ERROR_NULL;
     }
-    if (rc) {
-        s = LIBMQTT_ST_SEND_PUBLUSH;
-    } else if (qos == MQTT_QOS_1) {
-        s = LIBMQTT_ST_WAIT_PUBACK;
-    } else if (qos == MQTT_QOS_2) {
-        s = LIBMQTT_ST_WAIT_PUBREC;
-    } else {
+    if (!MQTT_IS_QOS(qos)) {
         return LIBMQTT_ERROR_QOS;
     }
-    if (__insert_pub(mqtt, &p, LIBMQTT_DIR_OUT, s)) {
+    tp = (struct libmqtt_topic *)malloc(sizeof *tp);
+    if (!tp) {
+        goto e1;
+    }
+    memset(tp, 0, sizeof *tp);
+    mqtt_b_dup(&tp->topic, topic);
+    if (!tp->topic.s) {
+        goto e2;
+    }
+    if (mqtt__template_init(&tp->t, &tp->topic, qos, retain)) {
+        goto e3;
+    }
+    tp->retain = retain;
+    tp->next = mqtt->topics;
+    mqtt->topics = tp;
+    *t = tp;
+    return LIBMQTT_SUCCESS;
+
+e3:
+    mqtt_b_free(&tp->topic);
+e2:
+    free(tp);
+e1:
+    return LIBMQTT_ERROR_MALLOC;
+}
+
+int libmqtt__publish_topic(struct libmqtt *mqtt, uint16_t *id, struct libmqtt_topic *t,
+                           const char *payload, int length) {
+    struct mqtt_packet p;
+    struct iovec iov[2];
+    int rc, count;
+
+    if (!mqtt || !t) {
+        return LIBMQTT_ERROR_NULL;
+    }
+    p.h.type = PUBLISH;
+    p.h.dup = 0;
+    p.h.retain = t->retain;
+    p.h.qos = t->t.qos;
+    p.v.publish.packet_id = 0;
+    if (t->t.qos > MQTT_QOS_0) {
+        p.v.publish.packet_id = __generate_packet_id(mqtt);
+    }
+    p.v.publish.topic_name = t->topic;
+    p.payload.s = (char *)payload;
+    p.payload.n = length;
+
+    if (-1 == (count = mqtt__template_iov(&t->t, p.v.publish.packet_id, &p.payload, iov))) {
         return LIBMQTT_ERROR_MALLOC;
     }
+
+    if (t->t.qos > MQTT_QOS_0 && id) {
+        *id = p.v.publish.packet_id;
+    }
+    rc = __writev(mqtt, iov, count);
+    return __published(mqtt, &p, rc);
+}
+
+int libmqtt__batch(struct libmqtt *mqtt, int batch) {
+    if (!mqtt) {
+        return LIBMQTT_ERROR_NULL;
+    }
+    if (!batch && !mqtt->batch.cork && __flush(mqtt)) {
+        mqtt->batch.on = 0;
+        return LIBMQTT_ERROR_WRITE;
+    }
+    mqtt->batch.on = batch;
+    return LIBMQTT_SUCCESS;
+}
+
+int libmqtt__cork(struct libmqtt *mqtt, int cork) {
+    if (!mqtt) {
+        return LIBMQTT_ERROR_NULL;
+    }
+    mqtt->batch.cork = cork;
+    if (!cork && !mqtt->batch.on && __flush(mqtt)) {
+        return LIBMQTT_ERROR_WRITE;
+    }
+    return LIBMQTT_SUCCESS;
+}
+
+int libmqtt__flush(struct libmqtt *mqtt) {
+    if (!mqtt) {
+        return LIBMQTT_ERROR_NULL;
+    }
+    if (__flush(mqtt)) {
+        return LIBMQTT_ERROR_WRITE;
+    }
+    return LIBMQTT_SUCCESS;
+}
+
+int libmqtt__read_max(struct libmqtt *mqtt, int size) {
+    if (!mqtt) {
+        return LIBMQTT_ERROR_NULL;
+    }
+    mqtt->rd.max = size < LIBMQTT_READ_BUFF ? LIBMQTT_READ_BUFF : size;
+    return LIBMQTT_SUCCESS;
+}
+
+int libmqtt__watermark(struct libmqtt *mqtt, int low, int high) {
+    if (!mqtt) {
+        return LIBMQTT_ERROR_NULL;
+    }
+    mqtt->wq.low = low;
+    mqtt->wq.high = high;
+    return LIBMQTT_SUCCESS;
+}
+
+int libmqtt__pending(struct libmqtt *mqtt) {
+    if (!mqtt) {
+        return LIBMQTT_ERROR_NULL;
+    }
+    return mqtt->wq.n + mqtt->batch.b.n;
+}
+
+int libmqtt__connect_timeout(struct libmqtt *mqtt, int timeout) {
+    if (!mqtt) {
+        return LIBMQTT_ERROR_NULL;
+    }
+    mqtt->conn.timeout = timeout;
+    return LIBMQTT_SUCCESS;
+}
+
+int libmqtt__dns_ttl(struct libmqtt *mqtt, int ttl) {
+    if (!mqtt) {
+        return LIBMQTT_ERROR_NULL;
+    }
+    mqtt->dns.ttl = ttl;
+    mqtt->dns.expire = 0;
+    return LIBMQTT_SUCCESS;
+}
+
+int libmqtt__sockopt(struct libmqtt *mqtt, struct libmqtt_sockopt *so) {
+    if (!mqtt || !so) {
+        return LIBMQTT_ERROR_NULL;
+    }
+    mqtt->so = *so;
+    return LIBMQTT_SUCCESS;
+}
+
+int libmqtt__zerocopy(struct libmqtt *mqtt, int threshold) {
+    if (!mqtt) {
+        return LIBMQTT_ERROR_NULL;
+    }
+    mqtt->zc.threshold = threshold;
+    return LIBMQTT_SUCCESS;
+}
+
+int libmqtt__reconnect(struct libmqtt *mqtt, int base, int max) {
+    if (!mqtt) {
+        return LIBMQTT_ERROR_NULL;
+    }
+    mqtt->reconn.base = base;
+    mqtt->reconn.max = max;
     return LIBMQTT_SUCCESS;
 }
 
@@ -952,8 +2757,23 @@ int libmqtt__disconnect(struct libmqtt *mqtt) {
     if (!mqtt) {
         return LIBMQTT_ERROR_NULL;
     }
+    mqtt->disconnect = 1;
+    if (mqtt->fd <= 0) {
+        /* waiting to reconnect, there is no connection to close. */
+        aeDeleteTimeEvent(mqtt->el, mqtt->reconn.id);
+        mqtt->reconn.id = -1;
+        aeStop(mqtt->el);
+        return LIBMQTT_SUCCESS;
+    }
     rc = __write(mqtt, b, sizeof b);
-    shutdown(mqtt->fd, SHUT_WR);
+    if (!rc) {
+        rc = __flush(mqtt);
+    }
+    if (mqtt->wq.n > 0) {
+        mqtt->wq.shutdown = 1;
+    } else {
+        __io_shutdown(mqtt);
+    }
     if (rc) {
         return LIBMQTT_ERROR_WRITE;
     }
@@ -961,10 +2781,61 @@ int libmqtt__disconnect(struct libmqtt *mqtt) {
     return LIBMQTT_SUCCESS;
 }
 
+int libmqtt__spin(struct libmqtt *mqtt, int spin, int cpu) {
+    if (!mqtt) {
+        return LIBMQTT_ERROR_NULL;
+    }
+    mqtt->spin.on = spin;
+    mqtt->spin.cpu = cpu;
+    return LIBMQTT_SUCCESS;
+}
+
+int libmqtt__latency(struct libmqtt *mqtt, int *p50, int *p99) {
+    if (!mqtt) {
+        return LIBMQTT_ERROR_NULL;
+    }
+    if (p50) {
+        *p50 = __lat_percentile(mqtt, 50);
+    }
+    if (p99) {
+        *p99 = __lat_percentile(mqtt, 99);
+    }
+    return LIBMQTT_SUCCESS;
+}
+
+/* poll without sleeping, aeMain's before sleep call is made here too. */
+static void
+__spin(struct libmqtt *mqtt) {
+    aeEventLoop *el;
+
+    el = mqtt->el;
+#if defined(__linux__) && defined(CPU_SET)
+    if (mqtt->spin.cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(mqtt->spin.cpu, &set);
+        if (-1 == sched_setaffinity(0, sizeof set, &set)) {
+            __log(mqtt, "pin to cpu %d: %s", mqtt->spin.cpu, strerror(errno));
+        }
+    }
+#endif
+    el->stop = 0;
+    while (!el->stop) {
+        __before_sleep(el);
+        aeProcessEvents(el, AE_ALL_EVENTS|AE_DONT_WAIT|AE_CALL_AFTER_SLEEP);
+    }
+    __log(mqtt, "spin: wake to callback p50 %d ns, p99 %d ns (%"PRIu32" samples)",
+          __lat_percentile(mqtt, 50), __lat_percentile(mqtt, 99), mqtt->lat.count);
+}
+
 int libmqtt__run(struct libmqtt *mqtt) {
     if (!mqtt) {
         return LIBMQTT_ERROR_NULL;
     }
-    aeMain(mqtt->el);
+    if (mqtt->spin.on) {
+        __spin(mqtt);
+    } else {
+        aeMain(mqtt->el);
+    }
     return LIBMQTT_SUCCESS;
 }
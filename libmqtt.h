@@ -51,7 +51,9 @@ extern "C" {
 #define LIBMQTT_ERROR_VSN           -4      /* error mqtt protocol version. */
 #define LIBMQTT_ERROR_CONNECT       -5      /* tcp connection error. */
 #define LIBMQTT_ERROR_WRITE         -6      /* tcp write error. */
-#define LIBMQTT_ERROR_MAXSUB        -7      /* max topic/qos per subscribe or unsubscribe. */
+#define LIBMQTT_ERROR_MAXSUB        -7      /* topic/qos count per subscribe or unsubscribe out of range. */
+#define LIBMQTT_ERROR_TLS           -8      /* tls setup error or no tls support. */
+#define LIBMQTT_ERROR_CALLBACK      -9      /* a callback the call depends on is not set. */
 
 /* default mqtt keep alive. */
 #define LIBMQTT_DEF_KEEPALIVE       30
@@ -59,15 +61,35 @@ extern "C" {
 /* mqtt packet retry time. */
 #define LIBMQTT_TIME_RETRY          20
 
+/* default tcp connect timeout in milliseconds. */
+#define LIBMQTT_DEF_CONNECT_TIMEOUT 5000
+
+/* default time in seconds a resolved broker address is reused. */
+#define LIBMQTT_DEF_DNS_TTL         60
+
+/* default reconnect backoff in milliseconds, 0 base disables reconnect. */
+#define LIBMQTT_DEF_RECONNECT_BASE  100
+#define LIBMQTT_DEF_RECONNECT_MAX   30000
+
+/* default output buffer watermarks in bytes. */
+#define LIBMQTT_DEF_HIGH_WATER      (4*1024*1024)
+#define LIBMQTT_DEF_LOW_WATER       (1*1024*1024)
+
 /* libmqtt data structure. */
 struct libmqtt;
 
+/* pre-encoded publish topic, owned by the libmqtt it was created on. */
+struct libmqtt_topic;
+
 /* libmqtt callbacks. */
 typedef void (*libmqtt__on_connack)(struct libmqtt *, void *ud, int ack_flags, enum mqtt_connack return_code);
 typedef void (*libmqtt__on_suback)(struct libmqtt *, void *ud, uint16_t id, int count, enum mqtt_qos *qos);
 typedef void (*libmqtt__on_unsuback)(struct libmqtt *, void *ud, uint16_t id);
 typedef void (*libmqtt__on_puback)(struct libmqtt *, void *ud, uint16_t id);
 typedef void (*libmqtt__on_publish)(struct libmqtt *, void *ud, const char *topic, enum mqtt_qos qos, int retain, const char *payload, int length);
+typedef void (*libmqtt__on_publish_chunk)(struct libmqtt *, void *ud, const char *topic, enum mqtt_qos qos, int retain, const char *chunk, int length, int offset, int total);
+typedef void (*libmqtt__on_watermark)(struct libmqtt *, void *ud, int high, int pending);
+typedef void (*libmqtt__on_reconnect)(struct libmqtt *, void *ud, int attempt, int elapsed, int rc);
 
 /* libmqtt callback structure. */
 struct libmqtt_cb {
@@ -76,6 +98,19 @@ struct libmqtt_cb {
     libmqtt__on_unsuback unsuback;
     libmqtt__on_puback puback;
     libmqtt__on_publish publish;
+    libmqtt__on_publish_chunk publish_chunk;
+    libmqtt__on_watermark watermark;
+    libmqtt__on_reconnect reconnect;
+};
+
+/* socket options applied on every connect and reconnect, 0 keeps the
+ * system default unless noted. */
+struct libmqtt_sockopt {
+    int sndbuf;             /* SO_SNDBUF in bytes. */
+    int rcvbuf;             /* SO_RCVBUF in bytes. */
+    int notsent_lowat;      /* TCP_NOTSENT_LOWAT in bytes. */
+    int keepalive;          /* tcp keepalive idle seconds, 0 SO_KEEPALIVE only, -1 off. */
+    int nagle;              /* 1 turns Nagle back on, 0 keeps TCP_NODELAY. */
 };
 
 /* string error message for a libmqtt return code. */
@@ -91,11 +126,31 @@ extern LIBMQTT_API int libmqtt__keep_alive(struct libmqtt *mqtt, uint16_t keep_a
 extern LIBMQTT_API int libmqtt__clean_sess(struct libmqtt *mqtt, int clean_sess);
 extern LIBMQTT_API int libmqtt__version(struct libmqtt *mqtt, enum mqtt_vsn vsn);
 extern LIBMQTT_API int libmqtt__auth(struct libmqtt *mqtt, const char *username, const char *password);
+extern LIBMQTT_API int libmqtt__max_packet(struct libmqtt *mqtt, int size);
+extern LIBMQTT_API int libmqtt__stream(struct libmqtt *mqtt, int threshold);
+extern LIBMQTT_API int libmqtt__strict(struct libmqtt *mqtt, int strict);
 extern LIBMQTT_API int libmqtt__will(struct libmqtt *mqtt, int retain, enum mqtt_qos qos, const char *topic, const char *payload, int payload_len);
+extern LIBMQTT_API int libmqtt__tls(struct libmqtt *mqtt, const char *ca_file, const char *cert_file, const char *key_file, int verify);
 extern LIBMQTT_API int libmqtt__connect(struct libmqtt *mqtt, const char *host, int port);
+extern LIBMQTT_API int libmqtt__connect_unix(struct libmqtt *mqtt, const char *path);
 extern LIBMQTT_API int libmqtt__subscribe(struct libmqtt *mqtt, uint16_t *id, int count, const char *topic[], enum mqtt_qos qos[]);
 extern LIBMQTT_API int libmqtt__unsubscribe(struct libmqtt *mqtt, uint16_t *id, int count, const char *topic[]);
 extern LIBMQTT_API int libmqtt__publish(struct libmqtt *mqtt, uint16_t *id, const char *topic, enum mqtt_qos qos, int retain, const char *payload, int length);
+extern LIBMQTT_API int libmqtt__topic(struct libmqtt *mqtt, struct libmqtt_topic **t, const char *topic, enum mqtt_qos qos, int retain);
+extern LIBMQTT_API int libmqtt__publish_topic(struct libmqtt *mqtt, uint16_t *id, struct libmqtt_topic *t, const char *payload, int length);
+extern LIBMQTT_API int libmqtt__batch(struct libmqtt *mqtt, int batch);
+extern LIBMQTT_API int libmqtt__cork(struct libmqtt *mqtt, int cork);
+extern LIBMQTT_API int libmqtt__flush(struct libmqtt *mqtt);
+extern LIBMQTT_API int libmqtt__read_max(struct libmqtt *mqtt, int size);
+extern LIBMQTT_API int libmqtt__watermark(struct libmqtt *mqtt, int low, int high);
+extern LIBMQTT_API int libmqtt__pending(struct libmqtt *mqtt);
+extern LIBMQTT_API int libmqtt__connect_timeout(struct libmqtt *mqtt, int timeout);
+extern LIBMQTT_API int libmqtt__dns_ttl(struct libmqtt *mqtt, int ttl);
+extern LIBMQTT_API int libmqtt__sockopt(struct libmqtt *mqtt, struct libmqtt_sockopt *so);
+extern LIBMQTT_API int libmqtt__zerocopy(struct libmqtt *mqtt, int threshold);
+extern LIBMQTT_API int libmqtt__reconnect(struct libmqtt *mqtt, int base, int max);
+extern LIBMQTT_API int libmqtt__spin(struct libmqtt *mqtt, int spin, int cpu);
+extern LIBMQTT_API int libmqtt__latency(struct libmqtt *mqtt, int *p50, int *p99);
 extern LIBMQTT_API int libmqtt__disconnect(struct libmqtt *mqtt);
 extern LIBMQTT_API int libmqtt__run(struct libmqtt *mqtt);
 
@@ -0,0 +1,483 @@
+/*
+ * libmqtt_bench_codec.c -- mqtt codec microbenchmark.
+ *
+ * Copyright (c) zhoukk <izhoukk@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define MQTT_IMPLEMENTATION
+#include "mqtt.h"
+
+#include <time.h>
+
+#define BENCH_MAX_CASE 32
+#define BENCH_SUB_TOPICS 128
+#define BENCH_LARGE_PAYLOAD (64*1024)
+
+struct bench_case {
+    const char *name;
+    const char *op;
+    /* run one round, return the number of packets handled or -1. */
+    int (*run)(struct bench_case *c);
+    struct mqtt_b in;
+    struct mqtt_packet pkt[2];
+    int npkt;
+    int bytes;
+    int64_t work;
+    double ns;
+    double base;
+};
+
+static int rounds = 200;
+static int repeat = 5;
+static int quiet = 0;
+static double threshold = 10.0;
+static char *only = 0;
+static char *baseline = 0;
+static char *output = 0;
+
+static struct bench_case cases[BENCH_MAX_CASE];
+static int ncase = 0;
+
+static struct mqtt_b sub_topics[BENCH_SUB_TOPICS];
+static char sub_names[BENCH_SUB_TOPICS][32];
+static enum mqtt_qos sub_qos[BENCH_SUB_TOPICS];
+static char large_payload[BENCH_LARGE_PAYLOAD];
+
+static uint64_t sink;
+/* packets the parser dispatched, checked against the expected count. */
+static int dispatched;
+
+
+static uint64_t
+__now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+__on_packet(void *ud, struct mqtt_packet *pkt) {
+    sink += pkt->h.type + pkt->payload.n;
+    dispatched++;
+    return 0;
+}
+
+static void
+__parser_init(struct mqtt_parser *p) {
+    int t;
+
+    mqtt__parse_init(p);
+    p->auth = 1;
+    for (t = CONNECT; t <= DISCONNECT; t++)
+        mqtt__parse_cb(p, t, __on_packet);
+}
+
+static int
+__run_serialize(struct bench_case *c) {
+    struct mqtt_b b;
+    int i, n;
+
+    n = 0;
+    for (i = 0; i < c->npkt; i++) {
+        if (mqtt__serialize(&c->pkt[i], &b))
+            return -1;
+        sink += b.n;
+        free(b.s);
+        n++;
+    }
+    return n;
+}
+
+static int
+__run_parse(struct bench_case *c) {
+    struct mqtt_parser p;
+    struct mqtt_b b;
+    int rc;
+
+    __parser_init(&p);
+    dispatched = 0;
+    b = c->in;
+    rc = mqtt__parse(&p, 0, &b);
+    mqtt__parse_free(&p);
+    return rc || dispatched != c->npkt ? -1 : c->npkt;
+}
+
+/* feed the input split in two at every byte boundary. */
+static int
+__run_parse_split(struct bench_case *c) {
+    struct mqtt_parser p;
+    struct mqtt_b b;
+    int i;
+
+    __parser_init(&p);
+    dispatched = 0;
+    for (i = 1; i < c->in.n; i++) {
+        b.s = c->in.s;
+        b.n = i;
+        if (mqtt__parse(&p, 0, &b))
+            goto e;
+        b.s = c->in.s + i;
+        b.n = c->in.n - i;
+        if (mqtt__parse(&p, 0, &b))
+            goto e;
+    }
+    mqtt__parse_free(&p);
+    if (dispatched != c->npkt * (c->in.n - 1))
+        return -1;
+    return dispatched;
+
+e:
+    mqtt__parse_free(&p);
+    return -1;
+}
+
+/* feed the input one byte at a time. */
+static int
+__run_parse_bytes(struct bench_case *c) {
+    struct mqtt_parser p;
+    struct mqtt_b b;
+    int i;
+
+    __parser_init(&p);
+    dispatched = 0;
+    for (i = 0; i < c->in.n; i++) {
+        b.s = c->in.s + i;
+        b.n = 1;
+        if (mqtt__parse(&p, 0, &b)) {
+            mqtt__parse_free(&p);
+            return -1;
+        }
+    }
+    mqtt__parse_free(&p);
+    return dispatched == c->npkt ? dispatched : -1;
+}
+
+static void
+__append(struct mqtt_b *in, struct mqtt_packet *pkt, int count) {
+    struct mqtt_b b;
+
+    mqtt__serialize(pkt, &b);
+    in->s = realloc(in->s, in->n + b.n * count);
+    while (count-- > 0) {
+        memcpy(in->s + in->n, b.s, b.n);
+        in->n += b.n;
+    }
+    free(b.s);
+}
+
+static struct bench_case *
+__case(const char *name, const char *op, int (*run)(struct bench_case *)) {
+    struct bench_case *c;
+
+    c = &cases[ncase++];
+    memset(c, 0, sizeof *c);
+    c->name = name;
+    c->op = op;
+    c->run = run;
+    return c;
+}
+
+static void
+__publish(struct mqtt_packet *pkt, enum mqtt_qos qos, char *payload, int length) {
+    memset(pkt, 0, sizeof *pkt);
+    pkt->h.type = PUBLISH;
+    pkt->h.qos = qos;
+    pkt->v.publish.topic_name.s = "sensors/room1/temp";
+    pkt->v.publish.topic_name.n = 18;
+    pkt->v.publish.packet_id = 1;
+    pkt->payload.s = payload;
+    pkt->payload.n = length;
+}
+
+static void
+__setup(void) {
+    struct mqtt_packet pkt[2], sub;
+    struct bench_case *c;
+    int i;
+
+    for (i = 0; i < BENCH_SUB_TOPICS; i++) {
+        sub_topics[i].n = snprintf(sub_names[i], sizeof sub_names[i], "devices/%03d/status/+", i);
+        sub_topics[i].s = sub_names[i];
+        sub_qos[i] = i % 3;
+    }
+    memset(large_payload, 'x', sizeof large_payload);
+
+    __publish(&pkt[0], MQTT_QOS_0, "21.5", 4);
+    c = __case("pub_qos0_small", "serialize", __run_serialize);
+    c->pkt[0] = pkt[0];
+    c->npkt = 1;
+    c = __case("pub_qos0_small", "parse", __run_parse);
+    __append(&c->in, &pkt[0], 256);
+    c->npkt = 256;
+
+    __publish(&pkt[0], MQTT_QOS_1, "21.5", 4);
+    memset(&pkt[1], 0, sizeof pkt[1]);
+    pkt[1].h.type = PUBACK;
+    pkt[1].v.puback.packet_id = 1;
+    c = __case("pub_qos1_ack", "serialize", __run_serialize);
+    c->pkt[0] = pkt[0];
+    c->pkt[1] = pkt[1];
+    c->npkt = 2;
+    c = __case("pub_qos1_ack", "parse", __run_parse);
+    for (i = 0; i < 128; i++) {
+        __append(&c->in, &pkt[0], 1);
+        __append(&c->in, &pkt[1], 1);
+    }
+    c->npkt = 256;
+
+    __publish(&pkt[0], MQTT_QOS_0, large_payload, sizeof large_payload);
+    c = __case("pub_large", "serialize", __run_serialize);
+    c->pkt[0] = pkt[0];
+    c->npkt = 1;
+    c = __case("pub_large", "parse", __run_parse);
+    __append(&c->in, &pkt[0], 4);
+    c->npkt = 4;
+
+    memset(&sub, 0, sizeof sub);
+    sub.h.type = SUBSCRIBE;
+    sub.h.qos = MQTT_QOS_1;
+    sub.v.subscribe.packet_id = 1;
+    sub.v.subscribe.topic_name = sub_topics;
+    sub.v.subscribe.qos = sub_qos;
+    sub.v.subscribe.n = BENCH_SUB_TOPICS;
+    c = __case("subscribe_128", "serialize", __run_serialize);
+    c->pkt[0] = sub;
+    c->npkt = 1;
+    c = __case("subscribe_128", "parse", __run_parse);
+    __append(&c->in, &sub, 16);
+    c->npkt = 16;
+
+    /* a mixed stream for the fragmentation cases. */
+    __publish(&pkt[0], MQTT_QOS_1, "21.5", 4);
+    c = __case("fragment_split", "parse", __run_parse_split);
+    __append(&c->in, &pkt[0], 1);
+    __append(&c->in, &pkt[1], 1);
+    __publish(&pkt[0], MQTT_QOS_0, large_payload, 512);
+    __append(&c->in, &pkt[0], 1);
+    sub.v.subscribe.n = 8;
+    __append(&c->in, &sub, 1);
+    c->npkt = 4;
+    cases[ncase] = *c;
+    cases[ncase].in.s = malloc(c->in.n);
+    memcpy(cases[ncase].in.s, c->in.s, c->in.n);
+    c = &cases[ncase++];
+    c->name = "fragment_bytes";
+    c->run = __run_parse_bytes;
+
+    for (i = 0; i < ncase; i++) {
+        c = &cases[i];
+        if (c->in.n) {
+            c->bytes = c->in.n;
+        } else {
+            struct mqtt_b b;
+            int k;
+            for (k = 0; k < c->npkt; k++) {
+                mqtt__serialize(&c->pkt[k], &b);
+                c->bytes += b.n;
+                free(b.s);
+            }
+        }
+        c->work = c->bytes;
+        if (c->run == __run_parse_split)
+            c->work *= c->bytes - 1;
+    }
+}
+
+static void
+__cleanup(void) {
+    int i;
+
+    for (i = 0; i < ncase; i++)
+        free(cases[i].in.s);
+}
+
+/* best of `repeat` timed runs, each one `rounds` passes over 64KB of work. */
+static int
+__measure(struct bench_case *c) {
+    uint64_t start, elapsed, best;
+    int64_t packets;
+    int i, k, n, iter;
+
+    iter = rounds * (64*1024 / c->work + 1);
+    best = 0;
+    packets = 0;
+    for (k = 0; k < repeat; k++) {
+        packets = 0;
+        start = __now();
+        for (i = 0; i < iter; i++) {
+            n = c->run(c);
+            if (n < 0) {
+                fprintf(stderr, "Error: %s %s failed.\n", c->name, c->op);
+                return -1;
+            }
+            packets += n;
+        }
+        elapsed = __now() - start;
+        if (k == 0 || elapsed < best)
+            best = elapsed;
+    }
+    c->ns = packets ? (double)best / packets : 0;
+    return 0;
+}
+
+static void
+__load_baseline(const char *path) {
+    FILE *f;
+    char name[64], op[64];
+    double ns;
+    int i;
+
+    f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Error: unable to open baseline %s.\n", path);
+        exit(1);
+    }
+    while (3 == fscanf(f, "%63s %63s %lf", name, op, &ns)) {
+        for (i = 0; i < ncase; i++) {
+            if (!strcmp(cases[i].name, name) && !strcmp(cases[i].op, op))
+                cases[i].base = ns;
+        }
+    }
+    fclose(f);
+}
+
+static void
+__save_baseline(const char *path) {
+    FILE *f;
+    int i;
+
+    f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "Error: unable to write baseline %s.\n", path);
+        exit(1);
+    }
+    for (i = 0; i < ncase; i++) {
+        if (cases[i].ns > 0)
+            fprintf(f, "%s %s %.2f\n", cases[i].name, cases[i].op, cases[i].ns);
+    }
+    fclose(f);
+}
+
+static void
+usage(void) {
+    printf("libmqtt_bench_codec measures the packet rate of mqtt__parse and mqtt__serialize.\n\n");
+    printf("Usage: libmqtt_bench_codec [-n rounds] [-r repeat] [-c case] [-b baseline [-t percent]] [-o output] [--quiet]\n");
+    printf("       libmqtt_bench_codec --help\n\n");
+    printf(" -b : compare against a baseline file, exit non-zero on regression.\n");
+    printf(" -c : run only the cases whose name starts with this prefix.\n");
+    printf(" -n : passes over 64KB of input per timed run. Defaults to 200.\n");
+    printf(" -o : write the results to a baseline file.\n");
+    printf(" -r : timed runs per case, the fastest one is reported. Defaults to 5.\n");
+    printf(" -t : allowed slowdown against the baseline in percent. Defaults to 10.\n");
+    printf(" --help : display this message.\n");
+    printf(" --quiet : only report regressions.\n");
+    exit(0);
+}
+
+static void
+config(int argc, char *argv[]) {
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--help")) {
+            usage();
+        } else if (!strcmp(argv[i], "--quiet")) {
+            quiet = 1;
+        } else if (i == argc-1) {
+            fprintf(stderr, "Error: %s argument given but no value specified.\n\n", argv[i]);
+            goto e;
+        } else if (!strcmp(argv[i], "-n")) {
+            rounds = atoi(argv[++i]);
+            if (rounds < 1) {
+                fprintf(stderr, "Error: Invalid rounds given: %d\n", rounds);
+                goto e;
+            }
+        } else if (!strcmp(argv[i], "-r")) {
+            repeat = atoi(argv[++i]);
+            if (repeat < 1) {
+                fprintf(stderr, "Error: Invalid repeat given: %d\n", repeat);
+                goto e;
+            }
+        } else if (!strcmp(argv[i], "-t")) {
+            threshold = atof(argv[++i]);
+            if (threshold < 0) {
+                fprintf(stderr, "Error: Invalid threshold given: %s\n", argv[i]);
+                goto e;
+            }
+        } else if (!strcmp(argv[i], "-c")) {
+            only = argv[++i];
+        } else if (!strcmp(argv[i], "-b")) {
+            baseline = argv[++i];
+        } else if (!strcmp(argv[i], "-o")) {
+            output = argv[++i];
+        } else {
+            goto unknown_option;
+        }
+    }
+    return;
+
+unknown_option:
+    fprintf(stderr, "Error: Unknown option '%s'.\n", argv[i]);
+e:
+    fprintf(stderr, "Use 'libmqtt_bench_codec --help' to see usage.\n");
+    exit(1);
+}
+
+int
+main(int argc, char *argv[]) {
+    struct bench_case *c;
+    int i, regress;
+
+    config(argc, argv);
+    __setup();
+    if (baseline)
+        __load_baseline(baseline);
+
+    if (!quiet)
+        printf("%-16s %-10s %8s %14s %10s %10s\n", "case", "op", "bytes", "packets/s", "ns/packet", "baseline");
+    regress = 0;
+    for (i = 0; i < ncase; i++) {
+        c = &cases[i];
+        if (only && strncmp(c->name, only, strlen(only)))
+            continue;
+        if (__measure(c)) {
+            regress++;
+            continue;
+        }
+        if (c->base > 0 && c->ns > c->base * (1 + threshold / 100)) {
+            fprintf(stderr, "Regression: %s %s %.2f ns/packet, baseline %.2f ns/packet.\n",
+                    c->name, c->op, c->ns, c->base);
+            regress++;
+        }
+        if (!quiet) {
+            printf("%-16s %-10s %8d %14.0f %10.2f", c->name, c->op, c->bytes, 1e9 / c->ns, c->ns);
+            if (c->base > 0)
+                printf(" %+9.1f%%\n", (c->ns / c->base - 1) * 100);
+            else
+                printf(" %10s\n", "-");
+        }
+    }
+    if (output)
+        __save_baseline(output);
+    __cleanup();
+    return regress ? 1 : 0;
+}
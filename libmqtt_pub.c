@@ -36,6 +36,12 @@ enum {
 };
 
 static char *host = 0;
+static char *unix_path = 0;
+static int tls = 0;
+static char *cafile = 0;
+static char *certfile = 0;
+static char *keyfile = 0;
+static int insecure = 0;
 static int port = 1883;
 static int debug = 0;
 static int quiet = 0;
@@ -68,7 +74,8 @@ usage(void) {
     printf("libmqtt_pub is a simple mqtt client that will publish a message on a single topic and exit.\n");
     printf("libmqtt_pub version %s running on libmqtt %d.%d.%d.\n\n", "0.0.0", 0, 0, 0);
     printf("Usage: libmqtt_pub [-h host] [-k keepalive] [-p port] [-q qos] [-r] {-f file | -l | -n | -m message} -t topic\n");
-    printf("                     [-i id] [-I id_prefix]\n");
+    printf("                     [-i id] [-I id_prefix] [--unix path]\n");
+    printf("                     [--tls] [--cafile file] [--cert file --key file] [--insecure]\n");
     printf("                     [-d] [--quiet]\n");
     printf("                     [-u username [-P password]]\n");
     printf("                     [--will-topic [--will-payload payload] [--will-qos qos] [--will-retain]]\n");
@@ -99,6 +106,12 @@ usage(void) {
     printf("                  length message will be sent.\n");
     printf(" --will-qos : QoS level for the client Will.\n");
     printf(" --will-retain : if given, make the client Will retained.\n");
+    printf(" --unix : connect to a broker through the unix domain socket at path, -h and -p are ignored.\n");
+    printf(" --tls : connect with tls, verifying the broker against the system certificate store.\n");
+    printf(" --cafile : path to a file of trusted CA certificates, implies --tls.\n");
+    printf(" --cert : client certificate for tls client authentication, implies --tls.\n");
+    printf(" --key : private key of the client certificate.\n");
+    printf(" --insecure : do not verify the broker certificate.\n");
     printf(" --will-topic : the topic on which to publish the client Will.\n");
     printf("\nSee https://github.com/zhoukk/libmqtt for more information.\n\n");
     exit(0);
@@ -293,6 +306,42 @@ config(int argc, char *argv[]) {
             i++;
         } else if (!strcmp(argv[i], "--will-retain")) {
             will_retain = 1;
+        } else if (!strcmp(argv[i], "--unix")) {
+            if (i == argc-1) {
+                fprintf(stderr, "Error: --unix argument given but no socket path specified.\n\n");
+                goto e;
+            } else {
+                unix_path = strdup(argv[i+1]);
+            }
+            i++;
+        } else if (!strcmp(argv[i], "--tls")) {
+            tls = 1;
+        } else if (!strcmp(argv[i], "--cafile")) {
+            if (i == argc-1) {
+                fprintf(stderr, "Error: --cafile argument given but no CA file specified.\n\n");
+                goto e;
+            } else {
+                cafile = strdup(argv[i+1]);
+            }
+            i++;
+        } else if (!strcmp(argv[i], "--cert")) {
+            if (i == argc-1) {
+                fprintf(stderr, "Error: --cert argument given but no certificate file specified.\n\n");
+                goto e;
+            } else {
+                certfile = strdup(argv[i+1]);
+            }
+            i++;
+        } else if (!strcmp(argv[i], "--key")) {
+            if (i == argc-1) {
+                fprintf(stderr, "Error: --key argument given but no key file specified.\n\n");
+                goto e;
+            } else {
+                keyfile = strdup(argv[i+1]);
+            }
+            i++;
+        } else if (!strcmp(argv[i], "--insecure")) {
+            insecure = 1;
         } else if (!strcmp(argv[i], "--will-topic")) {
             if (i == argc-1) {
                 fprintf(stderr, "Error: --will-topic argument given but no will topic specified.\n\n");
@@ -515,7 +564,14 @@ main(int argc, char *argv[]) {
     if (username) {
         if (!rc) rc = libmqtt__auth(mqtt, username, password);
     }
-    if (!rc) rc = libmqtt__connect(mqtt, host, port);
+    if (tls || cafile || certfile) {
+        if (!rc) rc = libmqtt__tls(mqtt, cafile, certfile, keyfile, !insecure);
+    }
+    if (unix_path) {
+        if (!rc) rc = libmqtt__connect_unix(mqtt, unix_path);
+    } else {
+        if (!rc) rc = libmqtt__connect(mqtt, host, port);
+    }
     if (!rc) rc = libmqtt__run(mqtt);
     libmqtt__destroy(mqtt);
     if (rc != LIBMQTT_SUCCESS) {
@@ -523,6 +579,10 @@ main(int argc, char *argv[]) {
     }
 
     free(host);
+    free(unix_path);
+    free(cafile);
+    free(certfile);
+    free(keyfile);
     free(topic);
     if (client_id)
         free(client_id);
@@ -0,0 +1,1004 @@
+/*
+ * libmqtt_test_codec.c -- mqtt codec validation tests.
+ *
+ * Copyright (c) zhoukk <izhoukk@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define MQTT_IMPLEMENTATION
+#include "mqtt.h"
+
+#define TEST_BUFF 512
+#define TEST_LARGE (16384 + 8)
+#define TEST_PACKETS 64
+
+static int failed = 0;
+static int packets = 0;
+
+
+static void
+__expect(const char *name, int ok) {
+    if (!ok) {
+        fprintf(stderr, "FAIL: %s\n", name);
+        failed++;
+    }
+}
+
+static int
+__on_packet(void *ud, struct mqtt_packet *pkt) {
+    packets++;
+    return 0;
+}
+
+/* frame a packet body, the remaining length always fits one byte here. */
+static int
+__frame(char *out, int header, const char *body, int n) {
+    out[0] = (char)header;
+    out[1] = (char)n;
+    memcpy(out + 2, body, n);
+    return n + 2;
+}
+
+/* append count PINGRESPs, bytes a runaway length could read into. */
+static int
+__trail(char *out, int count) {
+    int i, n;
+
+    for (i = 0, n = 0; i < count; i++)
+        n += __frame(out + n, 0xd0, "", 0);
+    return n;
+}
+
+/* parse buf, 0 if accepted and dispatched, -1 if rejected undispatched. */
+static int
+__parse(const char *buf, int n, int strict) {
+    struct mqtt_parser p;
+    struct mqtt_b b;
+    int t, rc;
+
+    mqtt__parse_init(&p);
+    mqtt__parse_strict(&p, strict);
+    p.auth = 1;
+    for (t = CONNECT; t <= DISCONNECT; t++)
+        mqtt__parse_cb(&p, t, __on_packet);
+    packets = 0;
+    b.s = (char *)buf;
+    b.n = n;
+    rc = mqtt__parse(&p, 0, &b);
+    mqtt__parse_free(&p);
+    if (rc == 0 && packets == 1)
+        return 0;
+    if (rc != 0 && packets == 0)
+        return -1;
+    return 1;
+}
+
+static int
+__check(int (*check)(struct mqtt_b *), const char *s, int n) {
+    struct mqtt_b b;
+
+    b.s = (char *)s;
+    b.n = n;
+    return check(&b);
+}
+
+/* the same string behind a long ascii prefix, to go through the vector scan. */
+static int
+__check_long(int (*check)(struct mqtt_b *), const char *s, int n) {
+    char buf[TEST_BUFF];
+
+    memset(buf, 'a', 64);
+    memcpy(buf + 64, s, n);
+    return __check(check, buf, 64 + n);
+}
+
+static void
+test_utf8(void) {
+    static const struct {
+        const char *name;
+        const char *s;
+        int n;
+        int rc;
+    } cases[] = {
+        { "utf8 ascii",                 "a/b",                  3,  0 },
+        { "utf8 two bytes",             "\xc3\xa9",             2,  0 },
+        { "utf8 three bytes",           "\xe2\x82\xac",         3,  0 },
+        { "utf8 four bytes",            "\xf0\x9f\x98\x80",     4,  0 },
+        { "utf8 last code point",       "\xf4\x8f\xbf\xbf",     4,  0 },
+        { "utf8 nul",                   "a\0b",                 3, -1 },
+        { "utf8 overlong nul",          "\xc0\x80",             2, -1 },
+        { "utf8 overlong two bytes",    "\xc1\xbf",             2, -1 },
+        { "utf8 overlong three bytes",  "\xe0\x80\xaf",         3, -1 },
+        { "utf8 overlong four bytes",   "\xf0\x80\x80\xaf",     4, -1 },
+        { "utf8 high surrogate",        "\xed\xa0\x80",         3, -1 },
+        { "utf8 low surrogate",         "\xed\xbf\xbf",         3, -1 },
+        { "utf8 above 10ffff",          "\xf4\x90\x80\x80",     4, -1 },
+        { "utf8 invalid lead byte",     "\xf8\x88\x80\x80\x80", 5, -1 },
+        { "utf8 lone continuation",     "\x80",                 1, -1 },
+        { "utf8 truncated sequence",    "\xe2\x82",             2, -1 },
+        { "utf8 bad continuation",      "\xe2\x28\xa1",         3, -1 },
+    };
+    char name[128];
+    int i;
+
+    for (i = 0; i < (int)(sizeof cases / sizeof cases[0]); i++) {
+        __expect(cases[i].name, __check(mqtt__check_utf8, cases[i].s, cases[i].n) == cases[i].rc);
+        snprintf(name, sizeof name, "%s (long)", cases[i].name);
+        __expect(name, __check_long(mqtt__check_utf8, cases[i].s, cases[i].n) == cases[i].rc);
+    }
+}
+
+static void
+test_topic(void) {
+    static const struct {
+        const char *name;
+        const char *s;
+        int filter;
+        int topic;
+    } cases[] = {
+        { "plain",                  "a/b/c",    0,  0 },
+        { "level separators only",  "///",      0,  0 },
+        { "empty",                  "",        -1, -1 },
+        { "hash",                   "#",        0, -1 },
+        { "hash last level",        "a/b/#",    0, -1 },
+        { "hash not last",          "a/#/b",   -1, -1 },
+        { "hash inside level",      "a/b#",    -1, -1 },
+        { "hash then more",         "a/##",    -1, -1 },
+        { "plus",                   "+",        0, -1 },
+        { "plus levels",            "a/+/+/c",  0, -1 },
+        { "plus inside level",      "a/b+/c",  -1, -1 },
+        { "plus then more",         "a/+b",    -1, -1 },
+    };
+    char name[128];
+    int i, n;
+
+    for (i = 0; i < (int)(sizeof cases / sizeof cases[0]); i++) {
+        n = strlen(cases[i].s);
+        snprintf(name, sizeof name, "filter %s", cases[i].name);
+        __expect(name, __check(mqtt__check_filter, cases[i].s, n) == cases[i].filter);
+        snprintf(name, sizeof name, "topic %s", cases[i].name);
+        __expect(name, __check(mqtt__check_topic, cases[i].s, n) == cases[i].topic);
+        if (n > 0) {
+            snprintf(name, sizeof name, "topic %s (long)", cases[i].name);
+            __expect(name, __check_long(mqtt__check_topic, cases[i].s, n) == cases[i].topic);
+        }
+    }
+}
+
+/* strict mode rejects what the checks reject, lenient mode passes it on. */
+static void
+test_strict(void) {
+    char buf[TEST_BUFF];
+    int n;
+
+    n = __frame(buf, 0x30, "\x00\x03" "a/b" "hi", 7);
+    __expect("strict publish", __parse(buf, n, 1) == 0);
+    n = __frame(buf, 0x30, "\x00\x03" "a/+" "hi", 7);
+    __expect("strict publish plus", __parse(buf, n, 1) == -1);
+    __expect("lenient publish plus", __parse(buf, n, 0) == 0);
+    n = __frame(buf, 0x30, "\x00\x03" "a/#" "hi", 7);
+    __expect("strict publish hash", __parse(buf, n, 1) == -1);
+    n = __frame(buf, 0x30, "\x00\x04" "a/\xc0\x80" "hi", 8);
+    __expect("strict publish overlong", __parse(buf, n, 1) == -1);
+    n = __frame(buf, 0x30, "\x00\x05" "a/\xed\xa0\x80" "hi", 9);
+    __expect("strict publish surrogate", __parse(buf, n, 1) == -1);
+    n = __frame(buf, 0x30, "\x00\x00" "hi", 4);
+    __expect("strict publish empty topic", __parse(buf, n, 1) == -1);
+
+    n = __frame(buf, 0x82, "\x00\x01" "\x00\x03" "a/#" "\x01", 8);
+    __expect("strict subscribe hash", __parse(buf, n, 1) == 0);
+    n = __frame(buf, 0x82, "\x00\x01" "\x00\x05" "a/#/b" "\x01", 10);
+    __expect("strict subscribe hash not last", __parse(buf, n, 1) == -1);
+    __expect("lenient subscribe hash not last", __parse(buf, n, 0) == 0);
+    n = __frame(buf, 0x82, "\x00\x01" "\x00\x03" "a/b" "\x01" "\x00\x02" "a#" "\x00", 13);
+    __expect("strict subscribe second filter", __parse(buf, n, 1) == -1);
+    n = __frame(buf, 0xa2, "\x00\x01" "\x00\x04" "+a/b", 8);
+    __expect("strict unsubscribe plus", __parse(buf, n, 1) == -1);
+}
+
+/* a PUBLISH whose payload bytes are their offset modulo 251. */
+static int
+__publish(char *out, int qos, int id, int n) {
+    char l[4];
+    int i, k, r_l;
+
+    r_l = 2 + 3 + (qos > 0 ? 2 : 0) + n;
+    out[0] = (char)(0x30 | qos << 1);
+    k = __pack_remain_length(r_l, l);
+    memcpy(out + 1, l, k);
+    k++;
+    memcpy(out + k, "\x00\x03" "a/b", 5);
+    k += 5;
+    if (qos > 0) {
+        out[k++] = (char)(id >> 8);
+        out[k++] = (char)(id & 0xff);
+    }
+    for (i = 0; i < n; i++)
+        out[k++] = (char)(i % 251);
+    return k;
+}
+
+static struct {
+    int calls;
+    int heads;
+    int bytes;
+    int total;
+    int id;
+    int bad;
+} chunks;
+
+static int
+__on_chunk(void *ud, struct mqtt_packet *pkt, struct mqtt_b *chunk, int offset) {
+    int i;
+
+    (void)ud;
+    chunks.calls++;
+    if (chunk->n == 0 && offset == 0 && chunks.bytes == 0) {
+        chunks.heads++;
+        chunks.total = pkt->payload.n;
+        chunks.id = pkt->v.publish.packet_id;
+        return 0;
+    }
+    if (offset != chunks.bytes || pkt->payload.n != chunks.total)
+        chunks.bad++;
+    for (i = 0; i < chunk->n; i++)
+        if ((uint8_t)chunk->s[i] != (offset + i) % 251)
+            chunks.bad++;
+    chunks.bytes += chunk->n;
+    return 0;
+}
+
+/* feed buf to a streaming parser in pieces of step bytes, the first
+ * piece is split bytes long. */
+static int
+__parse_stream(const char *buf, int n, int split, int step, int max) {
+    struct mqtt_parser p;
+    struct mqtt_b b;
+    int t, c, rc;
+
+    mqtt__parse_init(&p);
+    mqtt__parse_max(&p, max);
+    mqtt__parse_stream(&p, 16, __on_chunk);
+    p.auth = 1;
+    for (t = CONNECT; t <= DISCONNECT; t++)
+        mqtt__parse_cb(&p, t, __on_packet);
+    memset(&chunks, 0, sizeof chunks);
+    packets = 0;
+    rc = 0;
+    for (c = 0; c < n && !rc; c += b.n) {
+        b.s = (char *)buf + c;
+        b.n = c == 0 ? split : step;
+        if (b.n > n - c)
+            b.n = n - c;
+        rc = mqtt__parse(&p, 0, &b);
+    }
+    mqtt__parse_free(&p);
+    return rc;
+}
+
+static void
+test_stream(void) {
+    char buf[TEST_BUFF], name[128];
+    int n, qos, split, ok;
+
+    for (qos = 0; qos <= 2; qos++) {
+        n = __publish(buf, qos, 0x1234 + qos, 300);
+        for (split = 1, ok = 1; split < n; split++) {
+            if (__parse_stream(buf, n, split, n, 0) || packets != 0 || chunks.heads != 1
+                || chunks.bad || chunks.bytes != 300 || chunks.total != 300
+                || chunks.id != (qos > 0 ? 0x1234 + qos : 0))
+                ok = 0;
+        }
+        snprintf(name, sizeof name, "stream qos %d split feeds", qos);
+        __expect(name, ok);
+        ok = !__parse_stream(buf, n, 1, 1, 0) && chunks.heads == 1 && !chunks.bad
+            && chunks.bytes == 300 && chunks.calls == 301
+            && chunks.id == (qos > 0 ? 0x1234 + qos : 0);
+        snprintf(name, sizeof name, "stream qos %d byte at a time", qos);
+        __expect(name, ok);
+    }
+
+    /* at or under the threshold the packet is delivered whole. */
+    n = __publish(buf, 1, 7, 9);
+    __expect("stream small publish", !__parse_stream(buf, n, n, n, 0) && packets == 1 && chunks.calls == 0);
+    __expect("stream small publish split", !__parse_stream(buf, n, 3, 1, 0) && packets == 1 && chunks.calls == 0);
+
+    /* a threshold of 0 turns streaming off. */
+    n = __publish(buf, 1, 7, 300);
+    {
+        struct mqtt_parser p;
+        struct mqtt_b b;
+
+        mqtt__parse_init(&p);
+        mqtt__parse_stream(&p, 0, __on_chunk);
+        p.auth = 1;
+        mqtt__parse_cb(&p, PUBLISH, __on_packet);
+        memset(&chunks, 0, sizeof chunks);
+        packets = 0;
+        b.s = buf;
+        b.n = n;
+        __expect("stream threshold 0", !mqtt__parse(&p, 0, &b) && packets == 1 && chunks.calls == 0);
+        mqtt__parse_free(&p);
+    }
+
+    /* a body over max is refused before anything is dispatched. */
+    n = __publish(buf, 1, 7, 300);
+    __expect("max streamed", __parse_stream(buf, n, n, n, 200) && packets == 0 && chunks.calls == 0);
+    __expect("max streamed byte at a time", __parse_stream(buf, n, 1, 1, 200) && packets == 0 && chunks.calls == 0);
+    __expect("max at limit", !__parse_stream(buf, n, n, n, n - 3) && chunks.bytes == 300);
+    n = __publish(buf, 1, 7, 8);
+    __expect("max buffered", __parse_stream(buf, n, n, n, 12) && packets == 0 && chunks.calls == 0);
+    __expect("max buffered byte at a time", __parse_stream(buf, n, 1, 1, 12) && packets == 0 && chunks.calls == 0);
+    __expect("max buffered at limit", !__parse_stream(buf, n, 1, 1, n - 2) && packets == 1);
+}
+
+static int streamed;
+
+static int
+__on_count(void *ud, struct mqtt_packet *pkt, struct mqtt_b *chunk, int offset) {
+    (void)ud;
+    if (offset != streamed || pkt->payload.n < offset + chunk->n)
+        streamed = -1;
+    else
+        streamed += chunk->n;
+    return 0;
+}
+
+static int
+__on_length(void *ud, struct mqtt_packet *pkt) {
+    (void)ud;
+    packets++;
+    streamed = pkt->payload.n;
+    return 0;
+}
+
+/* feed n bytes, the first split of them alone, then one at a time up to
+ * the end of the fixed header, then the rest at once. */
+static int
+__parse_remain(char *buf, int n, int split, int head) {
+    struct mqtt_parser p;
+    struct mqtt_b b;
+    int c, rc;
+
+    mqtt__parse_init(&p);
+    if (split > 0)
+        mqtt__parse_stream(&p, 1 << 20, __on_count);
+    p.auth = 1;
+    mqtt__parse_cb(&p, PUBLISH, __on_length);
+    mqtt__parse_cb(&p, PINGRESP, __on_length);
+    packets = 0;
+    streamed = 0;
+    rc = 0;
+    for (c = 0; c < n && !rc; c += b.n) {
+        b.s = buf + c;
+        if (split <= 0)
+            b.n = n;
+        else if (c == 0)
+            b.n = split;
+        else if (c < head)
+            b.n = 1;
+        else
+            b.n = n - c;
+        rc = mqtt__parse(&p, 0, &b);
+    }
+    mqtt__parse_free(&p);
+    return rc;
+}
+
+static void
+test_length(void) {
+    static const struct {
+        int length;
+        int n;
+        const char *encoded;
+    } cases[] = {
+        { 0,            1, "\x00" },
+        { 127,          1, "\x7f" },
+        { 128,          2, "\x80\x01" },
+        { 16383,        2, "\xff\x7f" },
+        { 16384,        3, "\x80\x80\x01" },
+        { 2097151,      3, "\xff\xff\x7f" },
+        { 2097152,      4, "\x80\x80\x80\x01" },
+        { 268435455,    4, "\xff\xff\xff\x7f" },
+    };
+    char name[128], l[4];
+    char *buf;
+    int i, k, n, head, split, ok;
+
+    /* untouched pages of the largest body stay unallocated. */
+    buf = calloc(1, 5 + MQTT_MAX_LENGTH);
+    if (!buf) {
+        __expect("length buffer", 0);
+        return;
+    }
+    for (i = 0; i < (int)(sizeof cases / sizeof cases[0]); i++) {
+        k = __pack_remain_length(cases[i].length, l);
+        snprintf(name, sizeof name, "length %d encode", cases[i].length);
+        __expect(name, k == cases[i].n && !memcmp(l, cases[i].encoded, k));
+
+        buf[0] = (char)(cases[i].length ? 0x30 : 0xd0);
+        memcpy(buf + 1, l, k);
+        head = 1 + k;
+        n = head + cases[i].length;
+        if (cases[i].length)
+            memcpy(buf + head, "\x00\x01" "a", 3);
+
+        snprintf(name, sizeof name, "length %d one buffer", cases[i].length);
+        __expect(name, !__parse_remain(buf, n, 0, head) && packets == 1
+                 && streamed == (cases[i].length ? cases[i].length - 3 : 0));
+        for (split = 1, ok = 1; split <= head; split++) {
+            if (__parse_remain(buf, n, split, head)
+                || streamed != (cases[i].length ? cases[i].length - 3 : 0))
+                ok = 0;
+        }
+        snprintf(name, sizeof name, "length %d byte at a time", cases[i].length);
+        __expect(name, ok);
+        memset(buf, 0, head + 3);
+    }
+    free(buf);
+
+    buf = "\x30\xff\xff\xff\xff\x01" "\x00\x01" "a";
+    __expect("length five bytes", __parse(buf, 9, 0) == -1);
+    __expect("length five bytes one at a time", __parse_remain(buf, 9, 1, 6) == -1 && packets == 0);
+    __expect("length five bytes split", __parse_remain(buf, 9, 3, 6) == -1 && packets == 0);
+}
+
+/* list storage follows the entries present, not the body length. */
+static void
+test_lists(void) {
+    char buf[TEST_BUFF], body[TEST_BUFF];
+    struct mqtt_parser p;
+    struct mqtt_b b;
+    int t, n;
+
+    mqtt__parse_init(&p);
+    p.auth = 1;
+    for (t = CONNECT; t <= DISCONNECT; t++)
+        mqtt__parse_cb(&p, t, __on_packet);
+
+    memset(body, 0, sizeof body);
+    memcpy(body, "\x00\x01" "\x00\x30", 4);
+    memset(body + 4, 'a', 0x30);
+    body[4 + 0x30] = 1;
+    memcpy(body + 5 + 0x30, "\x00\x01" "b" "\x00", 4);
+    n = __frame(buf, 0x82, body, 9 + 0x30);
+    b.s = buf;
+    b.n = n;
+    __expect("lists subscribe", !mqtt__parse(&p, 0, &b) && p.p.v.subscribe.n == 2);
+    __expect("lists subscribe sized by entries", p.list.ntopic == 2 && p.list.nqos == 2);
+
+    memcpy(body, "\x00\x01" "\x00\x60", 4);
+    memset(body + 4, 'a', 0x60);
+    n = __frame(buf, 0xa2, body, 4 + 0x60);
+    b.s = buf;
+    b.n = n;
+    __expect("lists unsubscribe", !mqtt__parse(&p, 0, &b) && p.p.v.unsubscribe.n == 1);
+    __expect("lists unsubscribe sized by entries", p.list.ntopic == 2 && p.list.nqos == 2);
+
+    memset(body, 1, 100);
+    n = __frame(buf, 0x90, body, 100);
+    b.s = buf;
+    b.n = n;
+    __expect("lists suback", !mqtt__parse(&p, 0, &b) && p.p.v.suback.n == 98);
+    __expect("lists suback qos only", p.list.ntopic == 2 && p.list.nqos == 98);
+
+    n = __frame(buf, 0x82, "\x00\x01" "\x00\x02" "a" "\x01", 6);
+    n += __trail(buf + n, 1);
+    b.s = buf;
+    b.n = n;
+    __expect("lists subscribe entry past body", mqtt__parse(&p, 0, &b) == -1);
+    mqtt__parse_free(&p);
+}
+
+/* frame buf[0, cut), then the rest from where framing stopped. */
+static int
+__batch_resume(const char *buf, int n, int cut, const int *ends, int count) {
+    struct mqtt_view v[8];
+    struct mqtt_b b;
+    int i, k, used, done, start;
+
+    b.s = (char *)buf;
+    b.n = cut;
+    k = mqtt__parse_batch(&b, v, 8, &used);
+    for (done = 0; done < count && ends[done] <= cut; done++)
+        ;
+    if (k != done || used != (done ? ends[done - 1] : 0))
+        return -1;
+    for (i = 0; i < k; i++)
+        if (v[i].offset + v[i].length != ends[i])
+            return -1;
+    start = used;
+    b.s = (char *)buf + start;
+    b.n = n - start;
+    k = mqtt__parse_batch(&b, v, 8, &used);
+    if (k != count - done || start + used != n)
+        return -1;
+    for (i = 0; i < k; i++)
+        if (start + v[i].offset + v[i].length != ends[done + i])
+            return -1;
+    return 0;
+}
+
+static void
+test_batch(void) {
+    char buf[TEST_BUFF];
+    struct mqtt_parser p;
+    struct mqtt_view v[8];
+    struct mqtt_packet pkt;
+    struct mqtt_b b;
+    int ends[8];
+    int i, n, cut, ok, used, count;
+
+    n = 0;
+    count = 0;
+    n += __frame(buf + n, 0x40, "\x00\x01", 2);
+    ends[count++] = n;
+    n += __publish(buf + n, 1, 9, 200);
+    ends[count++] = n;
+    n += __frame(buf + n, 0x82, "\x00\x02" "\x00\x01" "a" "\x01" "\x00\x01" "b" "\x00", 10);
+    ends[count++] = n;
+    n += __trail(buf + n, 1);
+    ends[count++] = n;
+    n += __publish(buf + n, 0, 0, 150);
+    ends[count++] = n;
+
+    for (cut = 0, ok = 1; cut <= n; cut++) {
+        if (__batch_resume(buf, n, cut, ends, count))
+            ok = 0;
+    }
+    __expect("batch partial packet at every cut", ok);
+
+    b.s = buf;
+    b.n = n;
+    __expect("batch view limit", mqtt__parse_batch(&b, v, 2, &used) == 2 && used == ends[1]);
+    __expect("batch all", mqtt__parse_batch(&b, v, 8, &used) == count && used == n);
+
+    mqtt__parse_init(&p);
+    for (i = 0, ok = 1; i < count; i++) {
+        if (mqtt__parse_view(&p, buf, &v[i], &pkt))
+            ok = 0;
+    }
+    __expect("batch views decode", ok);
+    __expect("batch view publish", !mqtt__parse_view(&p, buf, &v[1], &pkt)
+             && pkt.h.qos == MQTT_QOS_1 && pkt.v.publish.packet_id == 9
+             && pkt.v.publish.topic_name.n == 3 && pkt.payload.n == 200
+             && (uint8_t)pkt.payload.s[199] == 199 % 251);
+    __expect("batch view subscribe", !mqtt__parse_view(&p, buf, &v[2], &pkt)
+             && pkt.v.subscribe.n == 2 && pkt.v.subscribe.qos[0] == MQTT_QOS_1
+             && pkt.v.subscribe.topic_name[1].s[0] == 'b');
+    mqtt__parse_max(&p, 200);
+    __expect("batch view over max", mqtt__parse_view(&p, buf, &v[1], &pkt) == -1);
+    __expect("batch view under max", !mqtt__parse_view(&p, buf, &v[4], &pkt));
+    mqtt__parse_free(&p);
+
+    /* a fifth length byte is malformed, not incomplete. */
+    memcpy(buf, "\x30\xff\xff\xff\xff\x01", 6);
+    b.s = buf;
+    b.n = 6;
+    __expect("batch five byte length", mqtt__parse_batch(&b, v, 8, &used) == -1);
+}
+
+static char fill[TEST_LARGE];
+static enum mqtt_qos fill_qos[TEST_LARGE];
+static struct mqtt_b fill_topic[TEST_PACKETS];
+static struct mqtt_packet all[TEST_PACKETS];
+static char all_names[TEST_PACKETS][32];
+static int all_length[TEST_PACKETS];
+static int nall;
+
+/* remaining lengths either side of the one to two and two to three byte
+ * length encodings. */
+static const int straddle[] = { 127, 128, 16383, 16384 };
+
+static void
+__build(enum mqtt_p_type type, enum mqtt_qos qos, int r_l) {
+    struct mqtt_packet *pkt;
+    struct mqtt_b *topic;
+
+    pkt = &all[nall];
+    topic = &fill_topic[nall];
+    memset(pkt, 0, sizeof *pkt);
+    pkt->h.type = type;
+    all_length[nall] = r_l;
+    topic->s = fill;
+    switch (type) {
+    case CONNECT:
+        pkt->v.connect.proto_name.s = "MQTT";
+        pkt->v.connect.proto_name.n = 4;
+        pkt->v.connect.proto_ver = MQTT_PROTO_V4;
+        pkt->v.connect.clean_sess = 1;
+        pkt->v.connect.keep_alive = 60;
+        pkt->v.connect.client_id.s = fill;
+        pkt->v.connect.client_id.n = r_l - 12;
+        break;
+    case CONNACK:
+        pkt->v.connack.ack_flags = 1;
+        pkt->v.connack.return_code = CONNACK_ACCEPTED;
+        break;
+    case PUBLISH:
+        pkt->h.qos = qos;
+        pkt->v.publish.topic_name.s = "a/b";
+        pkt->v.publish.topic_name.n = 3;
+        pkt->v.publish.packet_id = qos > MQTT_QOS_0 ? 0x1234 : 0;
+        pkt->payload.s = fill;
+        pkt->payload.n = r_l - 5 - (qos > MQTT_QOS_0 ? 2 : 0);
+        break;
+    case PUBACK:
+        pkt->v.puback.packet_id = 0x1234;
+        break;
+    case PUBREC:
+        pkt->v.pubrec.packet_id = 0x1234;
+        break;
+    case PUBREL:
+        pkt->v.pubrel.packet_id = 0x1234;
+        break;
+    case PUBCOMP:
+        pkt->v.pubcomp.packet_id = 0x1234;
+        break;
+    case SUBSCRIBE:
+        topic->n = r_l - 5;
+        pkt->v.subscribe.packet_id = 0x1234;
+        pkt->v.subscribe.topic_name = topic;
+        pkt->v.subscribe.qos = fill_qos;
+        pkt->v.subscribe.n = 1;
+        break;
+    case SUBACK:
+        pkt->v.suback.packet_id = 0x1234;
+        pkt->v.suback.qos = fill_qos;
+        pkt->v.suback.n = r_l - 2;
+        break;
+    case UNSUBSCRIBE:
+        topic->n = r_l - 4;
+        pkt->v.unsubscribe.packet_id = 0x1234;
+        pkt->v.unsubscribe.topic_name = topic;
+        pkt->v.unsubscribe.n = 1;
+        break;
+    case UNSUBACK:
+        pkt->v.unsuback.packet_id = 0x1234;
+        break;
+    default:
+        break;
+    }
+    if (type == PUBLISH)
+        snprintf(all_names[nall], sizeof all_names[nall], "%s qos%d %d", MQTT_TYPE_NAMES[type], qos, r_l);
+    else
+        snprintf(all_names[nall], sizeof all_names[nall], "%s %d", MQTT_TYPE_NAMES[type], r_l);
+    nall++;
+}
+
+/* every packet type, the variable sized ones at each straddling length. */
+static void
+__build_all(void) {
+    enum mqtt_p_type t;
+    int i, q;
+
+    for (i = 0; i < TEST_LARGE; i++) {
+        fill[i] = 'a' + i % 26;
+        fill_qos[i] = MQTT_QOS_1;
+    }
+    nall = 0;
+    for (t = CONNECT; t <= DISCONNECT; t++) {
+        switch (t) {
+        case PUBLISH:
+            for (q = MQTT_QOS_0; q <= MQTT_QOS_2; q++)
+                for (i = 0; i < 4; i++)
+                    __build(t, q, straddle[i]);
+            break;
+        case CONNECT:
+        case SUBSCRIBE:
+        case SUBACK:
+        case UNSUBSCRIBE:
+            for (i = 0; i < 4; i++)
+                __build(t, MQTT_QOS_0, straddle[i]);
+            break;
+        default:
+            __build(t, MQTT_QOS_0, t == CONNACK || (t >= PUBACK && t <= UNSUBACK) ? 2 : 0);
+            break;
+        }
+    }
+}
+
+static struct mqtt_b expect;
+static int matched;
+
+static int
+__on_reserialize(void *ud, struct mqtt_packet *pkt) {
+    struct mqtt_b b;
+
+    (void)ud;
+    packets++;
+    if (!mqtt__serialize(pkt, &b) && b.n == expect.n && !memcmp(b.s, expect.s, b.n))
+        matched++;
+    free(b.s);
+    return 0;
+}
+
+/* parse an encoded packet and encode what came out again, the parser
+ * is the reference the encoders are held to. */
+static int
+__reparse(struct mqtt_b *b) {
+    struct mqtt_parser p;
+    struct mqtt_b in;
+    enum mqtt_p_type t;
+    int rc;
+
+    mqtt__parse_init(&p);
+    p.auth = 1;
+    for (t = CONNECT; t <= DISCONNECT; t++)
+        mqtt__parse_cb(&p, t, __on_reserialize);
+    packets = 0;
+    matched = 0;
+    expect = *b;
+    in = *b;
+    rc = mqtt__parse(&p, 0, &in);
+    mqtt__parse_free(&p);
+    return !rc && packets == 1 && matched == 1 ? 0 : -1;
+}
+
+static void
+test_serialize(void) {
+    static char buf[TEST_LARGE];
+    static const struct {
+        enum mqtt_p_type type;
+        char s[4];
+    } fixed[] = {
+        { CONNACK,      MQTT_CONNACK(1, CONNACK_ACCEPTED) },
+        { PUBACK,       MQTT_PUBACK(0x1234) },
+        { PUBREC,       MQTT_PUBREC(0x1234) },
+        { PUBREL,       MQTT_PUBREL(0x1234) },
+        { PUBCOMP,      MQTT_PUBCOMP(0x1234) },
+        { UNSUBACK,     MQTT_UNSUBACK(0x1234) },
+        { PINGREQ,      MQTT_PINGREQ },
+        { PINGRESP,     MQTT_PINGRESP },
+        { DISCONNECT,   MQTT_DISCONNECT },
+    };
+    struct mqtt_packet *pkt;
+    struct mqtt_b b;
+    char name[64], l[4];
+    int i, k, size, ok;
+
+    __build_all();
+    for (i = 0; i < nall; i++) {
+        pkt = &all[i];
+        size = mqtt__packet_size(pkt);
+        snprintf(name, sizeof name, "serialize %s", all_names[i]);
+        if (mqtt__serialize(pkt, &b)) {
+            __expect(name, 0);
+            continue;
+        }
+        ok = b.n == size;
+        for (k = 0; k < (int)(sizeof fixed / sizeof fixed[0]); k++) {
+            if (fixed[k].type == pkt->h.type)
+                ok = ok && b.n == (fixed[k].s[1] ? 4 : 2) && !memcmp(b.s, fixed[k].s, b.n);
+        }
+        ok = ok && size == 1 + __pack_remain_length(all_length[i], l) + all_length[i];
+        ok = ok && !__reparse(&b);
+        __expect(name, ok);
+
+        snprintf(name, sizeof name, "serialize_into %s", all_names[i]);
+        memset(buf, 0xa5, size);
+        ok = mqtt__serialize_into(pkt, buf, size) == size && !memcmp(buf, b.s, size);
+        __expect(name, ok);
+
+        snprintf(name, sizeof name, "serialize_into short %s", all_names[i]);
+        memset(buf, 0xa5, size);
+        ok = mqtt__serialize_into(pkt, buf, size - 1) == -1;
+        for (k = 0; k < size; k++)
+            ok = ok && (uint8_t)buf[k] == 0xa5;
+        __expect(name, ok);
+        free(b.s);
+    }
+}
+
+static int
+__flatten(struct iovec *iov, int n, char *out) {
+    int i, c;
+
+    for (i = 0, c = 0; i < n; i++) {
+        memcpy(out + c, iov[i].iov_base, iov[i].iov_len);
+        c += iov[i].iov_len;
+    }
+    return c;
+}
+
+static void
+test_serialize_iov(void) {
+    static char head[TEST_LARGE], out[TEST_LARGE];
+    struct mqtt_packet *pkt;
+    struct iovec iov[2];
+    struct mqtt_b b;
+    char name[64];
+    int i, n, ok, cap;
+
+    __build_all();
+    __build(PUBLISH, MQTT_QOS_0, 5);
+    __build(PUBLISH, MQTT_QOS_1, 7);
+    for (i = 0; i < nall; i++) {
+        pkt = &all[i];
+        snprintf(name, sizeof name, "serialize_iov %s", all_names[i]);
+        if (mqtt__serialize(pkt, &b)) {
+            __expect(name, 0);
+            continue;
+        }
+        n = mqtt__serialize_iov(pkt, head, sizeof head, iov);
+        ok = n > 0 && __flatten(iov, n, out) == b.n && !memcmp(out, b.s, b.n);
+        if (pkt->h.type == PUBLISH && pkt->payload.n > 0)
+            ok = ok && n == 2 && iov[1].iov_base == pkt->payload.s;
+        else
+            ok = ok && n == 1;
+        __expect(name, ok);
+
+        snprintf(name, sizeof name, "serialize_iov short %s", all_names[i]);
+        cap = n > 0 ? (int)iov[0].iov_len - 1 : 0;
+        __expect(name, mqtt__serialize_iov(pkt, head, cap, iov) == -1);
+        free(b.s);
+    }
+}
+
+/* one template per qos reused across lengths whose encoding grows and
+ * shrinks, the header is rewritten in front of the topic each time. */
+static void
+test_template(void) {
+    static char out[TEST_LARGE];
+    static const int lengths[] = { 16384, 127, 16383, 128, 16384, 0 };
+    struct mqtt_p_template t;
+    struct mqtt_packet pkt;
+    struct iovec iov[2];
+    struct mqtt_b b, topic;
+    char name[64];
+    int i, n, q, ok;
+
+    __build_all();
+    topic.s = "a/b";
+    topic.n = 3;
+    for (q = MQTT_QOS_0; q <= MQTT_QOS_2; q++) {
+        if (mqtt__template_init(&t, &topic, q, q == MQTT_QOS_2)) {
+            __expect("template init", 0);
+            continue;
+        }
+        for (i = 0; i < (int)(sizeof lengths / sizeof lengths[0]); i++) {
+            memset(&pkt, 0, sizeof pkt);
+            pkt.h.type = PUBLISH;
+            pkt.h.qos = q;
+            pkt.h.retain = q == MQTT_QOS_2;
+            pkt.v.publish.topic_name = topic;
+            pkt.v.publish.packet_id = q > MQTT_QOS_0 ? 0x1200 + i : 0;
+            pkt.payload.s = fill;
+            pkt.payload.n = lengths[i] ? lengths[i] - 5 - (q > MQTT_QOS_0 ? 2 : 0) : 0;
+            snprintf(name, sizeof name, "template qos%d call %d", q, i);
+            if (mqtt__serialize(&pkt, &b)) {
+                __expect(name, 0);
+                continue;
+            }
+            n = mqtt__template_iov(&t, pkt.v.publish.packet_id, &pkt.payload, iov);
+            ok = n == (pkt.payload.n > 0 ? 2 : 1) && __flatten(iov, n, out) == b.n
+                 && !memcmp(out, b.s, b.n);
+            __expect(name, ok);
+            free(b.s);
+        }
+        mqtt__template_free(&t);
+    }
+}
+
+static void
+test_batch_append(void) {
+    static const char puback[] = MQTT_PUBACK(0x1234);
+    struct mqtt_batch batch;
+    struct mqtt_b b;
+    char *expect_s;
+    int i, k, n, ok;
+
+    __build_all();
+    for (i = 0, n = 0; i < nall; i++)
+        n += mqtt__packet_size(&all[i]);
+    expect_s = malloc(n + sizeof puback);
+    if (!expect_s) {
+        __expect("batch append buffer", 0);
+        return;
+    }
+    for (i = 0, n = 0, ok = 1; i < nall; i++) {
+        if (mqtt__serialize(&all[i], &b)) {
+            ok = 0;
+            continue;
+        }
+        memcpy(expect_s + n, b.s, b.n);
+        n += b.n;
+        free(b.s);
+    }
+    memcpy(expect_s + n, puback, sizeof puback);
+
+    mqtt__batch_init(&batch);
+    for (k = 0; k < 2; k++) {
+        for (i = 0; i < nall; i++) {
+            if (mqtt__batch_append(&batch, &all[i]))
+                ok = 0;
+        }
+        __expect(k ? "batch append after reset" : "batch append",
+                 ok && batch.count == nall && batch.n == n && !memcmp(batch.s, expect_s, n));
+        /* pre-encoded bytes go in without counting as a packet. */
+        __expect("batch write", !mqtt__batch_write(&batch, puback, sizeof puback)
+                 && batch.count == nall && batch.n == n + (int)sizeof puback
+                 && !memcmp(batch.s, expect_s, batch.n));
+        mqtt__batch_reset(&batch);
+    }
+    __expect("batch reset", batch.n == 0 && batch.count == 0 && batch.size > 0);
+    mqtt__batch_free(&batch);
+    free(expect_s);
+}
+
+/* a string length that runs past the body is rejected even when the
+ * bytes it would cover are in the buffer, as the next packet. */
+static void
+test_bounds(void) {
+    char buf[TEST_BUFF];
+    int n;
+
+    n = __frame(buf, 0x30, "\x00\x08" "a/b", 5);
+    n += __trail(buf + n, 3);
+    __expect("publish topic past body", __parse(buf, n, 0) == -1);
+    n = __frame(buf, 0x30, "\x00", 1);
+    n += __trail(buf + n, 1);
+    __expect("publish short length prefix", __parse(buf, n, 0) == -1);
+    n = __frame(buf, 0x32, "\x00\x03" "a/b" "\x00", 6);
+    n += __trail(buf + n, 1);
+    __expect("publish short packet id", __parse(buf, n, 0) == -1);
+    n = __frame(buf, 0x32, "\x00\x03" "a/b" "\x00\x01", 7);
+    __expect("publish qos 1 empty payload", __parse(buf, n, 0) == 0);
+
+    n = __frame(buf, 0x82, "\x00\x01" "\x00\x09" "a/b" "\x01", 8);
+    n += __trail(buf + n, 3);
+    __expect("subscribe filter past body", __parse(buf, n, 0) == -1);
+    n = __frame(buf, 0x82, "\x00\x01" "\x00\x03" "a/b", 7);
+    n += __trail(buf + n, 1);
+    __expect("subscribe missing qos", __parse(buf, n, 0) == -1);
+    n = __frame(buf, 0xa2, "\x00\x01" "\x00\x07" "a/b", 7);
+    n += __trail(buf + n, 2);
+    __expect("unsubscribe filter past body", __parse(buf, n, 0) == -1);
+
+    n = __frame(buf, 0x10, "\x00\x04" "MQTT" "\x04\x02\x00\x3c" "\x00\x10" "id", 14);
+    n += __trail(buf + n, 8);
+    __expect("connect client id past body", __parse(buf, n, 0) == -1);
+    n = __frame(buf, 0x10, "\x00\x04" "MQTT" "\x04\x02\x00\x3c" "\x00\x02" "id", 14);
+    __expect("connect", __parse(buf, n, 0) == 0);
+}
+
+int
+main(int argc, char *argv[]) {
+    (void)argc;
+    (void)argv;
+
+    test_utf8();
+    test_topic();
+    test_strict();
+    test_bounds();
+    test_stream();
+    test_batch();
+    test_lists();
+    test_length();
+    test_serialize();
+    test_serialize_iov();
+    test_template();
+    test_batch_append();
+    if (failed) {
+        fprintf(stderr, "%d codec test(s) failed.\n", failed);
+        return 1;
+    }
+    return 0;
+}
@@ -32,11 +32,18 @@ extern "C" {
 /* max topic/qos per subscribe or unsubscribe. */
 #define MQTT_MAX_SUB 128
 
+/* largest remaining length a four byte varint can carry. */
+#define MQTT_MAX_LENGTH 268435455
+
+/* packets between shrinks of the parser body buffer. */
+#define MQTT_PARSE_SHRINK 1024
+
 /* generic includes. */
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
 
 #if defined(__GNUC__) && (__GNUC__ >= 4)
 # define MQTT_API __attribute__((visibility("default")))
@@ -192,20 +199,20 @@ struct mqtt_p_pubcomp {
 
 struct mqtt_p_subscribe {
     uint16_t packet_id;
-    struct mqtt_b topic_name[MQTT_MAX_SUB];
-    enum mqtt_qos qos[MQTT_MAX_SUB];
+    struct mqtt_b *topic_name;
+    enum mqtt_qos *qos;
     int n;
 };
 
 struct mqtt_p_suback {
     uint16_t packet_id;
-    enum mqtt_qos qos[MQTT_MAX_SUB];
+    enum mqtt_qos *qos;
     int n;
 };
 
 struct mqtt_p_unsubscribe {
     uint16_t packet_id;
-    struct mqtt_b topic_name[MQTT_MAX_SUB];
+    struct mqtt_b *topic_name;
     int n;
 };
 
@@ -240,20 +247,69 @@ struct mqtt_packet {
     struct mqtt_b payload;
 };
 
+/* PUBLISH header for a fixed topic, qos and retain, encoded once. the
+ * buffer holds 5 spare bytes for the fixed header, the topic and room
+ * for the packet id. */
+struct mqtt_p_template {
+    char *s;
+    int n;
+    uint8_t h;
+    enum mqtt_qos qos;
+};
+
+/* growable buffer of packets encoded back to back. */
+struct mqtt_batch {
+    char *s;
+    int n;
+    int size;
+    int count;
+};
+
 enum mqtt_parser_state {
     MQTT_ST_FIXED,
     MQTT_ST_LENGTH,
     MQTT_ST_REMAIN,
+    MQTT_ST_HEAD,
+    MQTT_ST_STREAM,
 };
 
 typedef int (*mqtt_cb)(void *, struct mqtt_packet *);
+typedef int (*mqtt_chunk_cb)(void *, struct mqtt_packet *, struct mqtt_b *, int);
+
+struct mqtt_view {
+    enum mqtt_p_type type;
+    int flags;
+    int offset;
+    int length;
+};
 
 struct mqtt_parser {
     int auth;
     enum mqtt_parser_state state;
     int require;
     int multiplier;
+    int max;
+    int strict;
     struct mqtt_b remaining;
+    struct {
+        char *s;
+        int size;
+        int hwm;
+        int count;
+        int shrink;
+    } buff;
+    struct {
+        mqtt_chunk_cb cb;
+        int threshold;
+        int head;
+        int offset;
+    } stream;
+    struct {
+        struct mqtt_b *topic_name;
+        int ntopic;
+        enum mqtt_qos *qos;
+        int nqos;
+    } list;
     struct mqtt_packet p;
     mqtt_cb cb[MQTT_MAX_TYPE];
 };
@@ -290,9 +346,11 @@ mqtt_b_free(struct mqtt_b *b) {
     }
 }
 
-static inline void
+static inline int
 mqtt_b_read_utf(struct mqtt_b *b, struct mqtt_b *r) {
-    r->n = ((*(b->s) << 8) + *(b->s + 1));
+    if (b->n < 2) return -1;
+    r->n = (((uint8_t)*(b->s) << 8) + (uint8_t)*(b->s + 1));
+    if (r->n > b->n - 2) return -1;
     b->s += 2;
     b->n -= 2;
     if (r->n > 0) {
@@ -300,12 +358,13 @@ mqtt_b_read_utf(struct mqtt_b *b, struct mqtt_b *r) {
         b->s += r->n;
         b->n -= r->n;
     }
+    return 0;
 }
 
 static inline int
 mqtt_b_read_u8(struct mqtt_b *b) {
     int u8;
-    u8 = *(b->s);
+    u8 = (uint8_t)*(b->s);
     b->s += 1;
     b->n -= 1;
     return u8;
@@ -314,7 +373,7 @@ mqtt_b_read_u8(struct mqtt_b *b) {
 static inline int
 mqtt_b_read_u16(struct mqtt_b *b) {
     int u16;
-    u16 = ((*b->s << 8) + *(b->s + 1));
+    u16 = (((uint8_t)*b->s << 8) + (uint8_t)*(b->s + 1));
     b->s += 2;
     b->n -= 2;
     return u16;
@@ -341,11 +400,36 @@ mqtt_b_write_u16(struct mqtt_b *b, uint16_t r) {
     b->s[b->n++] = r & 0x00ff;
 }
 
+extern MQTT_API int mqtt__check_utf8(struct mqtt_b *b);
+extern MQTT_API int mqtt__check_topic(struct mqtt_b *b);
+extern MQTT_API int mqtt__check_filter(struct mqtt_b *b);
+
+extern MQTT_API int mqtt__packet_size(struct mqtt_packet *pkt);
+extern MQTT_API int mqtt__serialize_into(struct mqtt_packet *pkt, char *buf, int cap);
+extern MQTT_API int mqtt__serialize_iov(struct mqtt_packet *pkt, char *head, int cap, struct iovec iov[2]);
 extern MQTT_API int mqtt__serialize(struct mqtt_packet *pkt, struct mqtt_b *b);
 
+extern MQTT_API void mqtt__batch_init(struct mqtt_batch *b);
+extern MQTT_API void mqtt__batch_free(struct mqtt_batch *b);
+extern MQTT_API void mqtt__batch_reset(struct mqtt_batch *b);
+extern MQTT_API int mqtt__batch_append(struct mqtt_batch *b, struct mqtt_packet *pkt);
+extern MQTT_API int mqtt__batch_write(struct mqtt_batch *b, const char *s, int n);
+
+extern MQTT_API int mqtt__template_init(struct mqtt_p_template *t, struct mqtt_b *topic, enum mqtt_qos qos, int retain);
+extern MQTT_API void mqtt__template_free(struct mqtt_p_template *t);
+extern MQTT_API int mqtt__template_iov(struct mqtt_p_template *t, uint16_t packet_id, struct mqtt_b *payload, struct iovec iov[2]);
+
 extern MQTT_API void mqtt__parse_init(struct mqtt_parser *p);
+extern MQTT_API void mqtt__parse_free(struct mqtt_parser *p);
+extern MQTT_API void mqtt__parse_reset(struct mqtt_parser *p);
+extern MQTT_API void mqtt__parse_shrink(struct mqtt_parser *p, int packets);
+extern MQTT_API void mqtt__parse_max(struct mqtt_parser *p, int size);
+extern MQTT_API void mqtt__parse_strict(struct mqtt_parser *p, int strict);
+extern MQTT_API void mqtt__parse_stream(struct mqtt_parser *p, int threshold, mqtt_chunk_cb cb);
 extern MQTT_API void mqtt__parse_cb(struct mqtt_parser *p, enum mqtt_p_type t, mqtt_cb cb);
 extern MQTT_API int mqtt__parse(struct mqtt_parser *p, void *ud, struct mqtt_b *b);
+extern MQTT_API int mqtt__parse_batch(struct mqtt_b *b, struct mqtt_view *v, int n, int *used);
+extern MQTT_API int mqtt__parse_view(struct mqtt_parser *p, const char *base, struct mqtt_view *v, struct mqtt_packet *pkt);
 
 #ifdef __cplusplus
 }
@@ -356,10 +440,73 @@ extern MQTT_API int mqtt__parse(struct mqtt_parser *p, void *ud, struct mqtt_b *
 
 #ifdef MQTT_IMPLEMENTATION
 
+/* codec role, define one of these to strip the other side's packets. */
+#if !defined(MQTT_ROLE_CLIENT) && !defined(MQTT_ROLE_BROKER)
+# define MQTT_ROLE_CLIENT
+# define MQTT_ROLE_BROKER
+#endif
+
 void
 mqtt__parse_init(struct mqtt_parser *p) {
     memset(p, 0, sizeof *p);
     p->state = MQTT_ST_FIXED;
+    p->buff.shrink = MQTT_PARSE_SHRINK;
+}
+
+void
+mqtt__parse_free(struct mqtt_parser *p) {
+    if (p->buff.s) {
+        free(p->buff.s);
+        p->buff.s = 0;
+    }
+    p->buff.size = 0;
+    p->buff.hwm = 0;
+    p->buff.count = 0;
+    free(p->list.topic_name);
+    free(p->list.qos);
+    p->list.topic_name = 0;
+    p->list.ntopic = 0;
+    p->list.qos = 0;
+    p->list.nqos = 0;
+    p->remaining.s = 0;
+    p->remaining.n = 0;
+    p->state = MQTT_ST_FIXED;
+}
+
+/* forget a partially read packet and the CONNECT/CONNACK handshake, kept
+ * buffers, callbacks and limits are reused by the next connection. */
+void
+mqtt__parse_reset(struct mqtt_parser *p) {
+    p->auth = 0;
+    p->state = MQTT_ST_FIXED;
+    p->require = 0;
+    p->multiplier = 0;
+    p->remaining.s = 0;
+    p->remaining.n = 0;
+    p->stream.head = 0;
+    p->stream.offset = 0;
+}
+
+void
+mqtt__parse_shrink(struct mqtt_parser *p, int packets) {
+    p->buff.shrink = packets;
+    p->buff.count = 0;
+}
+
+void
+mqtt__parse_max(struct mqtt_parser *p, int size) {
+    p->max = size;
+}
+
+void
+mqtt__parse_strict(struct mqtt_parser *p, int strict) {
+    p->strict = strict;
+}
+
+void
+mqtt__parse_stream(struct mqtt_parser *p, int threshold, mqtt_chunk_cb cb) {
+    p->stream.threshold = threshold;
+    p->stream.cb = cb;
 }
 
 void
@@ -369,6 +516,226 @@ mqtt__parse_cb(struct mqtt_parser *p, enum mqtt_p_type t, mqtt_cb cb) {
     }
 }
 
+#if defined(__GNUC__) && (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+# define MQTT_SIMD_X86
+# include <immintrin.h>
+#elif defined(__GNUC__) && defined(__aarch64__) && defined(__ARM_NEON)
+# define MQTT_SIMD_NEON
+# include <arm_neon.h>
+#endif
+
+enum mqtt_check {
+    MQTT_CHECK_UTF8,
+    MQTT_CHECK_TOPIC,
+    MQTT_CHECK_FILTER,
+};
+
+/* index of the first NUL, non-ASCII or (if wild) wildcard byte, n if none. */
+static int
+__scan_scalar(const uint8_t *s, int n, int wild) {
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (s[i] == 0 || s[i] >= 0x80 || (wild && (s[i] == '+' || s[i] == '#')))
+            return i;
+    }
+    return n;
+}
+
+#ifdef MQTT_SIMD_X86
+static int
+__scan_sse2(const uint8_t *s, int n, int wild) {
+    __m128i z, p, h, v, m;
+    int i, bits;
+
+    z = _mm_setzero_si128();
+    p = _mm_set1_epi8(wild ? '+' : 0);
+    h = _mm_set1_epi8(wild ? '#' : 0);
+    for (i = 0; i + 16 <= n; i += 16) {
+        v = _mm_loadu_si128((const __m128i *)(s + i));
+        m = _mm_or_si128(_mm_cmpeq_epi8(v, z), _mm_or_si128(_mm_cmpeq_epi8(v, p), _mm_cmpeq_epi8(v, h)));
+        bits = _mm_movemask_epi8(_mm_or_si128(m, v));
+        if (bits)
+            return i + __builtin_ctz(bits);
+    }
+    return i + __scan_scalar(s + i, n - i, wild);
+}
+
+__attribute__((target("avx2"))) static int
+__scan_avx2(const uint8_t *s, int n, int wild) {
+    __m256i z, p, h, v, m;
+    unsigned bits;
+    int i;
+
+    z = _mm256_setzero_si256();
+    p = _mm256_set1_epi8(wild ? '+' : 0);
+    h = _mm256_set1_epi8(wild ? '#' : 0);
+    for (i = 0; i + 32 <= n; i += 32) {
+        v = _mm256_loadu_si256((const __m256i *)(s + i));
+        m = _mm256_or_si256(_mm256_cmpeq_epi8(v, z), _mm256_or_si256(_mm256_cmpeq_epi8(v, p), _mm256_cmpeq_epi8(v, h)));
+        bits = (unsigned)_mm256_movemask_epi8(_mm256_or_si256(m, v));
+        if (bits)
+            return i + __builtin_ctz(bits);
+    }
+    return i + __scan_sse2(s + i, n - i, wild);
+}
+#endif
+
+#ifdef MQTT_SIMD_NEON
+static int
+__scan_neon(const uint8_t *s, int n, int wild) {
+    uint8x16_t p, h, v, m;
+    int i;
+
+    p = vdupq_n_u8(wild ? '+' : 0);
+    h = vdupq_n_u8(wild ? '#' : 0);
+    for (i = 0; i + 16 <= n; i += 16) {
+        v = vld1q_u8(s + i);
+        m = vorrq_u8(vceqq_u8(v, vdupq_n_u8(0)), vorrq_u8(vceqq_u8(v, p), vceqq_u8(v, h)));
+        m = vorrq_u8(m, vcgeq_u8(v, vdupq_n_u8(0x80)));
+        if (vmaxvq_u8(m))
+            return i + __scan_scalar(s + i, 16, wild);
+    }
+    return i + __scan_scalar(s + i, n - i, wild);
+}
+#endif
+
+static int __scan_select(const uint8_t *s, int n, int wild);
+
+static int (*__scan)(const uint8_t *s, int n, int wild) = __scan_select;
+
+static int
+__scan_select(const uint8_t *s, int n, int wild) {
+#if defined(MQTT_SIMD_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        __scan = __scan_avx2;
+    else
+        __scan = __scan_sse2;
+#elif defined(MQTT_SIMD_NEON)
+    __scan = __scan_neon;
+#else
+    __scan = __scan_scalar;
+#endif
+    return __scan(s, n, wild);
+}
+
+/* length of a well-formed utf-8 sequence at s, -1 if malformed. */
+static int
+__utf8_seq(const uint8_t *s, int n) {
+    uint32_t cp;
+    int len, k;
+
+    if (s[0] >= 0xc2 && s[0] <= 0xdf) {
+        len = 2;
+        cp = s[0] & 0x1f;
+    } else if ((s[0] & 0xf0) == 0xe0) {
+        len = 3;
+        cp = s[0] & 0x0f;
+    } else if (s[0] >= 0xf0 && s[0] <= 0xf4) {
+        len = 4;
+        cp = s[0] & 0x07;
+    } else {
+        return -1;
+    }
+    if (n < len) return -1;
+    for (k = 1; k < len; k++) {
+        if ((s[k] & 0xc0) != 0x80) return -1;
+        cp = (cp << 6) | (s[k] & 0x3f);
+    }
+    if (len == 3 && (cp < 0x800 || (cp >= 0xd800 && cp <= 0xdfff))) return -1;
+    if (len == 4 && (cp < 0x10000 || cp > 0x10ffff)) return -1;
+    return len;
+}
+
+static int
+__check_string(struct mqtt_b *b, enum mqtt_check t) {
+    const uint8_t *s;
+    int i, n, len;
+
+    s = (const uint8_t *)b->s;
+    n = b->n;
+    i = 0;
+    while (i < n) {
+        i += __scan(s + i, n - i, t != MQTT_CHECK_UTF8);
+        if (i >= n) break;
+        if (s[i] == 0) {
+            return -1;
+        } else if (s[i] == '+' || s[i] == '#') {
+            if (t == MQTT_CHECK_TOPIC) return -1;
+            if (i > 0 && s[i-1] != '/') return -1;
+            if (s[i] == '#' && i != n - 1) return -1;
+            if (s[i] == '+' && i + 1 < n && s[i+1] != '/') return -1;
+            i++;
+        } else {
+            if ((len = __utf8_seq(s + i, n - i)) < 0) return -1;
+            i += len;
+        }
+    }
+    return 0;
+}
+
+int
+mqtt__check_utf8(struct mqtt_b *b) {
+    return __check_string(b, MQTT_CHECK_UTF8);
+}
+
+int
+mqtt__check_topic(struct mqtt_b *b) {
+    if (mqtt_b_empty(b)) return -1;
+    return __check_string(b, MQTT_CHECK_TOPIC);
+}
+
+int
+mqtt__check_filter(struct mqtt_b *b) {
+    if (mqtt_b_empty(b)) return -1;
+    return __check_string(b, MQTT_CHECK_FILTER);
+}
+
+#ifdef MQTT_ROLE_BROKER
+static int
+__check_connect(struct mqtt_packet *p) {
+    struct mqtt_p_connect *c;
+
+    c = &p->v.connect;
+    if (mqtt__check_utf8(&c->client_id))
+        return -1;
+    if (c->will_flag && mqtt__check_topic(&c->will_topic))
+        return -1;
+    if (mqtt__check_utf8(&c->username))
+        return -1;
+    return 0;
+}
+#endif
+
+static int
+__check_publish(struct mqtt_packet *p) {
+    return mqtt__check_topic(&p->v.publish.topic_name);
+}
+
+#ifdef MQTT_ROLE_BROKER
+static int
+__check_subscribe(struct mqtt_packet *p) {
+    int i;
+
+    for (i = 0; i < p->v.subscribe.n; i++) {
+        if (mqtt__check_filter(&p->v.subscribe.topic_name[i]))
+            return -1;
+    }
+    return 0;
+}
+
+static int
+__check_unsubscribe(struct mqtt_packet *p) {
+    int i;
+
+    for (i = 0; i < p->v.unsubscribe.n; i++) {
+        if (mqtt__check_filter(&p->v.unsubscribe.topic_name[i]))
+            return -1;
+    }
+    return 0;
+}
+
 static int
 __process_connect(struct mqtt_packet *p, void *ud, mqtt_cb cb) {
     struct mqtt_p_connect *c;
@@ -389,7 +756,9 @@ __process_connect(struct mqtt_packet *p, void *ud, mqtt_cb cb) {
     }
     return cb(ud, p);
 }
+#endif
 
+#ifdef MQTT_ROLE_CLIENT
 static int
 __process_connack(struct mqtt_packet *p, void *ud, mqtt_cb cb) {
     struct mqtt_p_connack *c;
@@ -400,6 +769,7 @@ __process_connack(struct mqtt_packet *p, void *ud, mqtt_cb cb) {
     }
     return cb(ud, p);
 }
+#endif
 
 static int
 __process_publish(struct mqtt_packet *p, void *ud, mqtt_cb cb) {
@@ -438,6 +808,7 @@ __process_pubcomp(struct mqtt_packet *p, void *ud, mqtt_cb cb) {
     return cb(ud, p);
 }
 
+#ifdef MQTT_ROLE_BROKER
 static int
 __process_subscribe(struct mqtt_packet *p, void *ud, mqtt_cb cb) {
     struct mqtt_p_subscribe *c;
@@ -454,12 +825,16 @@ __process_subscribe(struct mqtt_packet *p, void *ud, mqtt_cb cb) {
     }
     return cb(ud, p);
 }
+#endif
 
+#ifdef MQTT_ROLE_CLIENT
 static int
 __process_suback(struct mqtt_packet *p, void *ud, mqtt_cb cb) {
     return cb(ud, p);
 }
+#endif
 
+#ifdef MQTT_ROLE_BROKER
 static int
 __process_unsubscribe(struct mqtt_packet *p, void *ud, mqtt_cb cb) {
     struct mqtt_p_unsubscribe *c;
@@ -476,34 +851,44 @@ __process_unsubscribe(struct mqtt_packet *p, void *ud, mqtt_cb cb) {
     }
     return cb(ud, p);
 }
+#endif
 
+#ifdef MQTT_ROLE_CLIENT
 static int
 __process_unsuback(struct mqtt_packet *p, void *ud, mqtt_cb cb) {
     return cb(ud, p);
 }
+#endif
 
+#ifdef MQTT_ROLE_BROKER
 static int
 __process_pingreq(struct mqtt_packet *p, void *ud, mqtt_cb cb) {
     return cb(ud, p);
 }
+#endif
 
+#ifdef MQTT_ROLE_CLIENT
 static int
 __process_pingresp(struct mqtt_packet *p, void *ud, mqtt_cb cb) {
     return cb(ud, p);
 }
+#endif
 
+#ifdef MQTT_ROLE_BROKER
 static int
 __process_disconnect(struct mqtt_packet *p, void *ud, mqtt_cb cb) {
     return cb(ud, p);
 }
+#endif
 
 
+#ifdef MQTT_ROLE_BROKER
 static int
 __parse_connect(struct mqtt_packet *pkt, struct mqtt_b *remaining) {
     int flags;
 
     if (remaining->n <= 2) return -1;
-    mqtt_b_read_utf(remaining, &pkt->v.connect.proto_name);
+    if (mqtt_b_read_utf(remaining, &pkt->v.connect.proto_name)) return -1;
     if (remaining->n < 1) return -1;
     pkt->v.connect.proto_ver = mqtt_b_read_u8(remaining);
     if (remaining->n < 1) return -1;
@@ -517,24 +902,26 @@ __parse_connect(struct mqtt_packet *pkt, struct mqtt_b *remaining) {
     if (remaining->n < 2) return -1;
     pkt->v.connect.keep_alive = mqtt_b_read_u16(remaining);
     if (remaining->n < 2) return -1;
-    mqtt_b_read_utf(remaining, &pkt->v.connect.client_id);
+    if (mqtt_b_read_utf(remaining, &pkt->v.connect.client_id)) return -1;
     if (pkt->v.connect.will_flag) {
         if (remaining->n <= 2) return -1;
-        mqtt_b_read_utf(remaining, &pkt->v.connect.will_topic);
+        if (mqtt_b_read_utf(remaining, &pkt->v.connect.will_topic)) return -1;
         if (remaining->n <= 2) return -1;
-        mqtt_b_read_utf(remaining, &pkt->v.connect.will_payload);
+        if (mqtt_b_read_utf(remaining, &pkt->v.connect.will_payload)) return -1;
     }
     if ((flags >> 7) & 0x01) {
         if (remaining->n <= 2) return -1;
-        mqtt_b_read_utf(remaining, &pkt->v.connect.username);
+        if (mqtt_b_read_utf(remaining, &pkt->v.connect.username)) return -1;
         if ((flags >> 6) & 0x01) {
             if (remaining->n <= 2) return -1;
-            mqtt_b_read_utf(remaining, &pkt->v.connect.password);
+            if (mqtt_b_read_utf(remaining, &pkt->v.connect.password)) return -1;
         }
     }
     return 0;
 }
+#endif
 
+#ifdef MQTT_ROLE_CLIENT
 static int
 __parse_connack(struct mqtt_packet *pkt, struct mqtt_b *remaining) {
     if (remaining->n != 2) return -1;
@@ -542,13 +929,14 @@ __parse_connack(struct mqtt_packet *pkt, struct mqtt_b *remaining) {
     pkt->v.connack.return_code = mqtt_b_read_u8(remaining);
     return 0;
 }
+#endif
 
 static int
 __parse_publish(struct mqtt_packet *pkt, struct mqtt_b *remaining) {
     if (remaining->n <= 2) return -1;
-    mqtt_b_read_utf(remaining, &pkt->v.publish.topic_name);
+    if (mqtt_b_read_utf(remaining, &pkt->v.publish.topic_name)) return -1;
     if (pkt->h.qos > MQTT_QOS_0) {
-        if (remaining->n <= 2) return -1;
+        if (remaining->n < 2) return -1;
         pkt->v.publish.packet_id = mqtt_b_read_u16(remaining);
     }
     pkt->payload = *remaining;
@@ -583,6 +971,7 @@ __parse_pubcomp(struct mqtt_packet *pkt, struct mqtt_b *remaining) {
     return 0;
 }
 
+#ifdef MQTT_ROLE_BROKER
 static int
 __parse_subscribe(struct mqtt_packet *pkt, struct mqtt_b *remaining) {
     int rc;
@@ -593,41 +982,44 @@ __parse_subscribe(struct mqtt_packet *pkt, struct mqtt_b *remaining) {
 
     n = 0;
     rc = 0;
-    while (remaining->n > 0 && n < MQTT_MAX_SUB) {
+    while (remaining->n > 0) {
         if (remaining->n <= 3) {
             rc = -1;
             break;
         }
-        mqtt_b_read_utf(remaining, &pkt->v.subscribe.topic_name[n]);
-        pkt->v.subscribe.qos[n] = mqtt_b_read_u8(remaining);
-        if (remaining->n < 0) {
+        if (mqtt_b_read_utf(remaining, &pkt->v.subscribe.topic_name[n]) || remaining->n < 1) {
             rc = -1;
             break;
         }
+        pkt->v.subscribe.qos[n] = mqtt_b_read_u8(remaining);
         n++;
     }
     pkt->v.subscribe.n = n;
     return rc;
 }
+#endif
 
+#ifdef MQTT_ROLE_CLIENT
 static int
 __parse_suback(struct mqtt_packet *pkt, struct mqtt_b *remaining) {
     int rc;
     int n;
 
     if (remaining->n <= 2) return -1;
-    pkt->v.subscribe.packet_id = mqtt_b_read_u16(remaining);
+    pkt->v.suback.packet_id = mqtt_b_read_u16(remaining);
 
     n = 0;
     rc = 0;
-    while (remaining->n > 0 && n < MQTT_MAX_SUB) {
+    while (remaining->n > 0) {
         pkt->v.suback.qos[n] = mqtt_b_read_u8(remaining);
         n++;
     }
     pkt->v.suback.n = n;
     return rc;
 }
+#endif
 
+#ifdef MQTT_ROLE_BROKER
 static int
 __parse_unsubscribe(struct mqtt_packet *pkt, struct mqtt_b *remaining) {
     int rc;
@@ -638,13 +1030,12 @@ __parse_unsubscribe(struct mqtt_packet *pkt, struct mqtt_b *remaining) {
 
     n = 0;
     rc = 0;
-    while (remaining->n > 0 && n < MQTT_MAX_SUB) {
+    while (remaining->n > 0) {
         if (remaining->n <= 2) {
             rc = -1;
             break;
         }
-        mqtt_b_read_utf(remaining, &pkt->v.unsubscribe.topic_name[n]);
-        if (remaining->n < 0) {
+        if (mqtt_b_read_utf(remaining, &pkt->v.unsubscribe.topic_name[n])) {
             rc = -1;
             break;
         }
@@ -653,110 +1044,212 @@ __parse_unsubscribe(struct mqtt_packet *pkt, struct mqtt_b *remaining) {
     pkt->v.unsubscribe.n = n;
     return rc;
 }
+#endif
 
+#ifdef MQTT_ROLE_CLIENT
 static int
 __parse_unsuback(struct mqtt_packet *pkt, struct mqtt_b *remaining) {
     if (remaining->n != 2) return -1;
     pkt->v.unsuback.packet_id = mqtt_b_read_u16(remaining);
     return 0;
 }
+#endif
 
+#ifdef MQTT_ROLE_BROKER
 static int
 __parse_pingreq(struct mqtt_packet *pkt, struct mqtt_b *remaining) {
     if (remaining->n != 0) return -1;
     return 0;
 }
+#endif
 
+#ifdef MQTT_ROLE_CLIENT
 static int
 __parse_pingresp(struct mqtt_packet *pkt, struct mqtt_b *remaining) {
     if (remaining->n != 0) return -1;
     return 0;
 }
+#endif
 
+#ifdef MQTT_ROLE_BROKER
 static int
 __parse_disconnect(struct mqtt_packet *pkt, struct mqtt_b *remaining) {
     if (remaining->n != 0) return -1;
     return 0;
 }
+#endif
 
 
+#ifdef MQTT_ROLE_BROKER
+/* count the topics of a subscribe-family body, -1 if one runs past it. */
 static int
-__process(struct mqtt_parser *p, void *ud) {
-    int rc;
-    enum mqtt_p_type type;
-    mqtt_cb cb;
-    struct mqtt_b b;
+__list_count(struct mqtt_b *b, int qos) {
+    const uint8_t *s;
+    int c, n;
 
-    type = p->p.h.type;
-    if (p->auth == 0 && (type != CONNECT && type != CONNACK)) {
-        return -1;
+    s = (const uint8_t *)b->s;
+    n = 0;
+    for (c = 2; c < b->n; n++) {
+        if (b->n - c < 2) {
+            return -1;
+        }
+        c += 2 + (s[c] << 8 | s[c + 1]) + qos;
     }
-    cb = p->cb[type];
-    if (!cb) {
-        return -1;
+    return c == b->n || b->n <= 2 ? n : -1;
+}
+#endif
+
+static int
+__list_reserve(struct mqtt_parser *p, int ntopic, int nqos) {
+    struct mqtt_b *topic_name;
+    enum mqtt_qos *qos;
+
+    if (ntopic > p->list.ntopic) {
+        topic_name = realloc(p->list.topic_name, ntopic * sizeof *topic_name);
+        if (!topic_name) {
+            return -1;
+        }
+        p->list.topic_name = topic_name;
+        p->list.ntopic = ntopic;
     }
-    b.s = p->remaining.s;
-    b.n = p->remaining.n;
-    switch (type) {
+    if (nqos > p->list.nqos) {
+        qos = realloc(p->list.qos, nqos * sizeof *qos);
+        if (!qos) {
+            return -1;
+        }
+        p->list.qos = qos;
+        p->list.nqos = nqos;
+    }
+    return 0;
+}
+
+static int
+__dispatch(struct mqtt_parser *p, struct mqtt_packet *pkt, struct mqtt_b *b, void *ud, mqtt_cb cb) {
+    int rc, strict;
+
+    strict = p->strict;
+
+    switch (pkt->h.type) {
+#ifdef MQTT_ROLE_BROKER
     case CONNECT:
-        rc = __parse_connect(&p->p, &b);
-        if (!rc) rc = __process_connect(&p->p, ud, cb);
+        rc = __parse_connect(pkt, b);
+        if (!rc && strict) rc = __check_connect(pkt);
+        if (!rc) rc = __process_connect(pkt, ud, cb);
         break;
+#endif
+#ifdef MQTT_ROLE_CLIENT
     case CONNACK:
-        rc = __parse_connack(&p->p, &b);
-        if (!rc) rc = __process_connack(&p->p, ud, cb);
+        rc = __parse_connack(pkt, b);
+        if (!rc) rc = __process_connack(pkt, ud, cb);
         break;
+#endif
     case PUBLISH:
-        rc = __parse_publish(&p->p, &b);
-        if (!rc) rc = __process_publish(&p->p, ud, cb);
+        rc = __parse_publish(pkt, b);
+        if (!rc && strict) rc = __check_publish(pkt);
+        if (!rc) rc = __process_publish(pkt, ud, cb);
         break;
     case PUBACK:
-        rc = __parse_puback(&p->p, &b);
-        if (!rc) rc = __process_puback(&p->p, ud, cb);
+        rc = __parse_puback(pkt, b);
+        if (!rc) rc = __process_puback(pkt, ud, cb);
         break;
     case PUBREC:
-        rc = __parse_pubrec(&p->p, &b);
-        if (!rc) rc = __process_pubrec(&p->p, ud, cb);
+        rc = __parse_pubrec(pkt, b);
+        if (!rc) rc = __process_pubrec(pkt, ud, cb);
         break;
     case PUBREL:
-        rc = __parse_pubrel(&p->p, &b);
-        if (!rc) rc = __process_pubrel(&p->p, ud, cb);
+        rc = __parse_pubrel(pkt, b);
+        if (!rc) rc = __process_pubrel(pkt, ud, cb);
         break;
     case PUBCOMP:
-        rc = __parse_pubcomp(&p->p, &b);
-        if (!rc) rc = __process_pubcomp(&p->p, ud, cb);
+        rc = __parse_pubcomp(pkt, b);
+        if (!rc) rc = __process_pubcomp(pkt, ud, cb);
         break;
+#ifdef MQTT_ROLE_BROKER
     case SUBSCRIBE:
-        rc = __parse_subscribe(&p->p, &b);
-        if (!rc) rc = __process_subscribe(&p->p, ud, cb);
+        rc = __list_count(b, 1);
+        if (rc < 0 || __list_reserve(p, rc, rc)) {
+            rc = -1;
+            break;
+        }
+        pkt->v.subscribe.topic_name = p->list.topic_name;
+        pkt->v.subscribe.qos = p->list.qos;
+        rc = __parse_subscribe(pkt, b);
+        if (!rc && strict) rc = __check_subscribe(pkt);
+        if (!rc) rc = __process_subscribe(pkt, ud, cb);
         break;
+#endif
+#ifdef MQTT_ROLE_CLIENT
     case SUBACK:
-        rc = __parse_suback(&p->p, &b);
-        if (!rc) rc = __process_suback(&p->p, ud, cb);
+        if (__list_reserve(p, 0, b->n - 2)) {
+            rc = -1;
+            break;
+        }
+        pkt->v.suback.qos = p->list.qos;
+        rc = __parse_suback(pkt, b);
+        if (!rc) rc = __process_suback(pkt, ud, cb);
         break;
+#endif
+#ifdef MQTT_ROLE_BROKER
     case UNSUBSCRIBE:
-        rc = __parse_unsubscribe(&p->p, &b);
-        if (!rc) rc = __process_unsubscribe(&p->p, ud, cb);
+        rc = __list_count(b, 0);
+        if (rc < 0 || __list_reserve(p, rc, 0)) {
+            rc = -1;
+            break;
+        }
+        pkt->v.unsubscribe.topic_name = p->list.topic_name;
+        rc = __parse_unsubscribe(pkt, b);
+        if (!rc && strict) rc = __check_unsubscribe(pkt);
+        if (!rc) rc = __process_unsubscribe(pkt, ud, cb);
         break;
+#endif
+#ifdef MQTT_ROLE_CLIENT
     case UNSUBACK:
-        rc = __parse_unsuback(&p->p, &b);
-        if (!rc) rc = __process_unsuback(&p->p, ud, cb);
+        rc = __parse_unsuback(pkt, b);
+        if (!rc) rc = __process_unsuback(pkt, ud, cb);
         break;
+#endif
+#ifdef MQTT_ROLE_BROKER
     case PINGREQ:
-        rc = __parse_pingreq(&p->p, &b);
-        if (!rc) rc = __process_pingreq(&p->p, ud, cb);
+        rc = __parse_pingreq(pkt, b);
+        if (!rc) rc = __process_pingreq(pkt, ud, cb);
         break;
+#endif
+#ifdef MQTT_ROLE_CLIENT
     case PINGRESP:
-        rc = __parse_pingresp(&p->p, &b);
-        if (!rc) rc = __process_pingresp(&p->p, ud, cb);
+        rc = __parse_pingresp(pkt, b);
+        if (!rc) rc = __process_pingresp(pkt, ud, cb);
         break;
+#endif
+#ifdef MQTT_ROLE_BROKER
     case DISCONNECT:
-        rc = __parse_disconnect(&p->p, &b);
-        if (!rc) rc = __process_disconnect(&p->p, ud, cb);
+        rc = __parse_disconnect(pkt, b);
+        if (!rc) rc = __process_disconnect(pkt, ud, cb);
         break;
+#endif
     default:
         rc = -1;
     }
+    return rc;
+}
+
+static int
+__process(struct mqtt_parser *p, void *ud) {
+    int rc;
+    enum mqtt_p_type type;
+    mqtt_cb cb;
+    struct mqtt_b b;
+
+    type = p->p.h.type;
+    if (p->auth == 0 && (type != CONNECT && type != CONNACK)) {
+        return -1;
+    }
+    cb = p->cb[type];
+    if (!cb) {
+        return -1;
+    }
+    b.s = p->remaining.s;
+    b.n = p->remaining.n;
+    rc = __dispatch(p, &p->p, &b, ud, cb);
     if (rc) {
         return rc;
     }
@@ -766,63 +1259,189 @@ __process(struct mqtt_parser *p, void *ud) {
     return 0;
 }
 
-int
-mqtt__parse(struct mqtt_parser *p, void *ud, struct mqtt_b *b) {
-    const char *c, *e;
-    int offset;
-
-    e = b->s + b->n;
-    c = b->s;
-    while (c < e) {
-        switch (p->state) {
-        case MQTT_ST_FIXED:
-            p->p.h.type = (((*c) >> 4) & 0x0F);
-            p->p.h.dup = (((*c) >> 3) & 0x01);
-            p->p.h.qos = (((*c) >> 1) & 0x03);
-            p->p.h.retain = (((*c) >> 0) & 0x01);
-            p->state = MQTT_ST_LENGTH;
-            p->multiplier = 1;
-            p->remaining.n = 0;
-            p->remaining.s = 0;
-            p->require = 0;
-            c++;
-            break;
-        case MQTT_ST_LENGTH:
-            p->remaining.n += ((*c) & 127) * p->multiplier;
-            p->multiplier *= 128;
-            if (p->multiplier > 128 * 128 * 128) {
-                return -1;
-            }
-            if (((*c) & 128) == 0) {
-                p->require = p->remaining.n;
-                if (p->require > 0) {
-                    p->state = MQTT_ST_REMAIN;
-                    p->remaining.s = malloc(p->remaining.n);
-                    if (!p->remaining.s) {
-                        return -1;
-                    }
-                } else {
-                    int rc;
+static int
+__process_stream(struct mqtt_parser *p, void *ud) {
+    struct mqtt_b b, chunk;
 
-                    p->state = MQTT_ST_FIXED;
-                    rc = __process(p, ud);
-                    mqtt_b_free(&p->remaining);
-                    if (rc)
-                        return rc;
-                }
-            }
+    if (p->auth == 0) {
+        return -1;
+    }
+    b.s = p->remaining.s;
+    b.n = p->remaining.n;
+    if (mqtt_b_read_utf(&b, &p->p.v.publish.topic_name)) {
+        return -1;
+    }
+    if (p->p.h.qos > MQTT_QOS_0) {
+        p->p.v.publish.packet_id = mqtt_b_read_u16(&b);
+    }
+    if (mqtt_b_empty(&p->p.v.publish.topic_name)) {
+        return -1;
+    }
+    if (p->strict && __check_publish(&p->p)) {
+        return -1;
+    }
+    p->p.payload.s = 0;
+    p->p.payload.n = p->require;
+    chunk.s = 0;
+    chunk.n = 0;
+    return p->stream.cb(ud, &p->p, &chunk, 0);
+}
+
+static char *
+__parse_reserve(struct mqtt_parser *p, int n) {
+    if (n > p->buff.size) {
+        free(p->buff.s);
+        p->buff.size = 0;
+        p->buff.s = malloc(n);
+        if (!p->buff.s) {
+            return 0;
+        }
+        p->buff.size = n;
+    }
+    if (n > p->buff.hwm) {
+        p->buff.hwm = n;
+    }
+    return p->buff.s;
+}
+
+static void
+__parse_release(struct mqtt_parser *p) {
+    p->remaining.s = 0;
+    p->remaining.n = 0;
+    if (p->buff.shrink <= 0 || ++p->buff.count < p->buff.shrink) {
+        return;
+    }
+    if (p->buff.size > p->buff.hwm) {
+        free(p->buff.s);
+        p->buff.s = 0;
+        p->buff.size = 0;
+        if (p->buff.hwm > 0 && (p->buff.s = malloc(p->buff.hwm)) != 0) {
+            p->buff.size = p->buff.hwm;
+        }
+    }
+    p->buff.hwm = 0;
+    p->buff.count = 0;
+}
+
+/* decode a remaining length, returns bytes used, 0 if incomplete, -1 if malformed. */
+static inline int
+__unpack_remain_length(const uint8_t *s, int n, int *length) {
+    uint32_t v, stop;
+    int k;
+
+    if (n >= 4) {
+        v = s[0] | (uint32_t)s[1] << 8 | (uint32_t)s[2] << 16 | (uint32_t)s[3] << 24;
+    } else {
+        v = 0x80808080u;
+        for (k = 0; k < n; k++)
+            v = (v & ~(0xffu << (8 * k))) | (uint32_t)s[k] << (8 * k);
+    }
+    stop = ~v & 0x80808080u;
+    if (!stop) {
+        return n >= 4 ? -1 : 0;
+    }
+    k = 1 + ((stop & 0x80u) == 0) + ((stop & 0x8080u) == 0) + ((stop & 0x808080u) == 0);
+    v &= 0x7f7f7f7fu >> (32 - 8 * k);
+    *length = (v & 0x7f) | ((v >> 1) & 0x3f80) | ((v >> 2) & 0x1fc000) | ((v >> 3) & 0xfe00000);
+    return k;
+}
+
+static int
+__parse_length(struct mqtt_parser *p, void *ud, const char **c, const char *e) {
+    int rc;
+
+    if (p->max > 0 && p->remaining.n > p->max) {
+        return -1;
+    }
+    p->require = p->remaining.n;
+    if (p->p.h.type == PUBLISH && p->stream.cb && p->stream.threshold > 0 && p->require > p->stream.threshold) {
+        /* buffer topic and packet id only, payload is streamed. */
+        if (!MQTT_IS_QOS(p->p.h.qos)) {
+            return -1;
+        }
+        p->remaining.s = __parse_reserve(p, 2);
+        if (!p->remaining.s) {
+            return -1;
+        }
+        p->remaining.n = 0;
+        p->stream.head = 2;
+        p->stream.offset = 0;
+        p->state = MQTT_ST_HEAD;
+    } else if (e - *c >= p->require) {
+        /* whole body is in the input buffer, parse it in place. */
+        p->state = MQTT_ST_FIXED;
+        p->remaining.s = p->require > 0 ? (char *)*c : 0;
+        *c += p->require;
+        rc = __process(p, ud);
+        __parse_release(p);
+        if (rc)
+            return rc;
+    } else {
+        p->state = MQTT_ST_REMAIN;
+        p->remaining.s = __parse_reserve(p, p->remaining.n);
+        if (!p->remaining.s) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int
+mqtt__parse(struct mqtt_parser *p, void *ud, struct mqtt_b *b) {
+    const char *c, *e;
+    int offset, n, rc;
+
+    e = b->s + b->n;
+    c = b->s;
+    while (c < e) {
+        switch (p->state) {
+        case MQTT_ST_FIXED:
+            p->p.h.type = (((*c) >> 4) & 0x0F);
+            p->p.h.dup = (((*c) >> 3) & 0x01);
+            p->p.h.qos = (((*c) >> 1) & 0x03);
+            p->p.h.retain = (((*c) >> 0) & 0x01);
+            p->remaining.n = 0;
+            p->remaining.s = 0;
+            p->require = 0;
             c++;
+            n = __unpack_remain_length((const uint8_t *)c, e - c, &p->remaining.n);
+            if (n < 0) {
+                return -1;
+            }
+            if (n > 0) {
+                c += n;
+                rc = __parse_length(p, ud, &c, e);
+                if (rc)
+                    return rc;
+            } else {
+                p->state = MQTT_ST_LENGTH;
+                p->multiplier = 1;
+                p->remaining.n = 0;
+            }
+            break;
+        case MQTT_ST_LENGTH:
+            if (p->multiplier > 128 * 128 * 128) {
+                return -1;
+            }
+            p->remaining.n += ((*c) & 127) * p->multiplier;
+            p->multiplier *= 128;
+            if (p->max > 0 && p->remaining.n > p->max) {
+                return -1;
+            }
+            if (((*c++) & 128) == 0) {
+                rc = __parse_length(p, ud, &c, e);
+                if (rc)
+                    return rc;
+            }
             break;
         case MQTT_ST_REMAIN:
             offset = p->remaining.n - p->require;
             if (e - c >= p->require) {
-                int rc;
-
                 memcpy(p->remaining.s + offset, c, p->require);
                 c += p->require;
                 p->state = MQTT_ST_FIXED;
                 rc = __process(p, ud);
-                mqtt_b_free(&p->remaining);
+                __parse_release(p);
                 if (rc)
                     return rc;
             } else {
@@ -831,49 +1450,168 @@ mqtt__parse(struct mqtt_parser *p, void *ud, struct mqtt_b *b) {
                 c = e;
             }
             break;
+        case MQTT_ST_HEAD:
+            n = e - c < p->stream.head ? e - c : p->stream.head;
+            if (n > p->require) {
+                return -1;
+            }
+            memcpy(p->remaining.s + p->remaining.n, c, n);
+            p->remaining.n += n;
+            p->require -= n;
+            p->stream.head -= n;
+            c += n;
+            if (p->stream.head == 0 && p->remaining.n == 2) {
+                char l[2];
+
+                memcpy(l, p->remaining.s, 2);
+                p->stream.head = (((uint8_t)l[0] << 8) | (uint8_t)l[1]);
+                if (p->p.h.qos > MQTT_QOS_0) {
+                    p->stream.head += 2;
+                }
+                if (p->stream.head > p->require) {
+                    return -1;
+                }
+                p->remaining.s = __parse_reserve(p, 2 + p->stream.head);
+                if (!p->remaining.s) {
+                    return -1;
+                }
+                memcpy(p->remaining.s, l, 2);
+            }
+            if (p->stream.head == 0) {
+                rc = __process_stream(p, ud);
+                if (p->require == 0) {
+                    p->state = MQTT_ST_FIXED;
+                    __parse_release(p);
+                } else {
+                    p->state = MQTT_ST_STREAM;
+                }
+                if (rc)
+                    return rc;
+            }
+            break;
+        case MQTT_ST_STREAM:
+            {
+                struct mqtt_b chunk;
+
+                chunk.s = (char *)c;
+                chunk.n = e - c < p->require ? e - c : p->require;
+                offset = p->stream.offset;
+                p->stream.offset += chunk.n;
+                p->require -= chunk.n;
+                c += chunk.n;
+                rc = p->stream.cb(ud, &p->p, &chunk, offset);
+                if (p->require == 0) {
+                    p->state = MQTT_ST_FIXED;
+                    __parse_release(p);
+                }
+                if (rc)
+                    return rc;
+            }
+            break;
+        }
+    }
+    return 0;
+}
+
+/* frame up to n complete packets, *used is where a partial packet starts. */
+int
+mqtt__parse_batch(struct mqtt_b *b, struct mqtt_view *v, int n, int *used) {
+    const uint8_t *s;
+    int i, c, length, k;
+
+    s = (const uint8_t *)b->s;
+    c = 0;
+    for (i = 0; i < n && c + 2 <= b->n; i++) {
+        k = __unpack_remain_length(s + c + 1, b->n - c - 1, &length);
+        if (k < 0) {
+            return -1;
+        }
+        if (k == 0) {
+            break;
+        }
+        k += c + 1;
+        if (b->n - k < length) {
+            break;
         }
+        v[i].type = (s[c] >> 4) & 0x0F;
+        v[i].flags = s[c] & 0x0F;
+        v[i].offset = k;
+        v[i].length = length;
+        c = k + length;
     }
+    if (used) {
+        *used = c;
+    }
+    return i;
+}
+
+static int
+__accept(void *ud, struct mqtt_packet *pkt) {
     return 0;
 }
 
+/* decode one framed packet under the parser's limits, no callback runs.
+ * subscribe-family lists point into the parser and are only valid until
+ * the next call on it. */
+int
+mqtt__parse_view(struct mqtt_parser *p, const char *base, struct mqtt_view *v, struct mqtt_packet *pkt) {
+    struct mqtt_b b;
+
+    if (p->max > 0 && v->length > p->max) {
+        return -1;
+    }
+    memset(pkt, 0, sizeof *pkt);
+    pkt->h.type = v->type;
+    pkt->h.dup = ((v->flags >> 3) & 0x01);
+    pkt->h.qos = ((v->flags >> 1) & 0x03);
+    pkt->h.retain = (v->flags & 0x01);
+    b.s = v->length > 0 ? (char *)base + v->offset : 0;
+    b.n = v->length;
+    return __dispatch(p, pkt, &b, 0, __accept);
+}
+
 static int
 __pack_remain_length(int length, char l[]) {
-    int n = 0;
-    do {
-        char c;
-        c = length % 128;
-        length /= 128;
-        if (length > 0)
-            c |= 128;
-        l[n++] = c;
-    } while (length > 0);
+    int n;
+
+    n = 1 + (length >= 0x80) + (length >= 0x4000) + (length >= 0x200000);
+    l[0] = (char)((length & 0x7f) | ((n > 1) << 7));
+    l[1] = (char)(((length >> 7) & 0x7f) | ((n > 2) << 7));
+    l[2] = (char)(((length >> 14) & 0x7f) | ((n > 3) << 7));
+    l[3] = (char)((length >> 21) & 0x7f);
     return n;
 }
 
+#ifdef MQTT_ROLE_CLIENT
 static int
-__serialize_connect(struct mqtt_packet *pkt, struct mqtt_b *b) {
+__length_connect(struct mqtt_packet *pkt) {
     int r_l;
-    int flags;
-    int l_len;
-    char l[4];
-    int i;
 
-    flags = 0;
     r_l = 8 + pkt->v.connect.proto_name.n;
     r_l += pkt->v.connect.client_id.n;
-    r_l += pkt->v.connect.username.n;
-    r_l += pkt->v.connect.password.n;
     if (pkt->v.connect.username.n > 0) {
-        flags |= (1 << 7);
-        r_l += 2;
-        if (pkt->v.connect.password.n > 0) {
-            flags |= (1 << 6);
-            r_l += 2;
-        }
+        r_l += 2 + pkt->v.connect.username.n;
+        if (pkt->v.connect.password.n > 0)
+            r_l += 2 + pkt->v.connect.password.n;
     }
     if (pkt->v.connect.will_flag) {
         r_l += 2 + pkt->v.connect.will_topic.n;
         r_l += 2 + pkt->v.connect.will_payload.n;
+    }
+    return r_l;
+}
+
+static void
+__serialize_connect(struct mqtt_packet *pkt, struct mqtt_b *b) {
+    int flags;
+
+    flags = 0;
+    if (pkt->v.connect.username.n > 0) {
+        flags |= (1 << 7);
+        if (pkt->v.connect.password.n > 0)
+            flags |= (1 << 6);
+    }
+    if (pkt->v.connect.will_flag) {
         flags |= (1 << 2);
         if (pkt->v.connect.will_retain)
             flags |= (1 << 5);
@@ -881,14 +1619,6 @@ __serialize_connect(struct mqtt_packet *pkt, struct mqtt_b *b) {
     }
     if (pkt->v.connect.clean_sess)
         flags |= (1 << 1);
-    l_len = __pack_remain_length(r_l, l);
-    b->n = l_len + r_l + 1;
-    b->s = malloc(b->n);
-    if (!b->s) return -1;
-    b->n = 0;
-    mqtt_b_write_u8(b, 0x10);
-    for (i = 0; i < l_len; i++)
-        mqtt_b_write_u8(b, l[i]);
     mqtt_b_write_utf(b, &pkt->v.connect.proto_name);
     mqtt_b_write_u8(b, (uint8_t)pkt->v.connect.proto_ver);
     mqtt_b_write_u8(b, (uint8_t)flags);
@@ -903,248 +1633,398 @@ __serialize_connect(struct mqtt_packet *pkt, struct mqtt_b *b) {
         if (pkt->v.connect.password.n > 0)
             mqtt_b_write_utf(b, &pkt->v.connect.password);
     }
-    return 0;
 }
 
 static int
-__serialize_connack(struct mqtt_packet *pkt, struct mqtt_b *b) {
-    b->s = malloc(4);
-    if (!b->s) return -1;
-    b->n = 0;
-    mqtt_b_write_u8(b, 0x20);
-    mqtt_b_write_u8(b, 0x02);
-    mqtt_b_write_u8(b, (uint8_t)pkt->v.connack.ack_flags);
-    mqtt_b_write_u8(b, (uint8_t)pkt->v.connack.return_code);
-    return 0;
+__length_subscribe(struct mqtt_packet *pkt) {
+    int r_l;
+    int i;
+
+    r_l = 2;
+    for (i = 0; i < pkt->v.subscribe.n; i++)
+        r_l += 2 + pkt->v.subscribe.topic_name[i].n + 1;
+    return r_l;
+}
+
+static void
+__serialize_subscribe(struct mqtt_packet *pkt, struct mqtt_b *b) {
+    int i;
+
+    mqtt_b_write_u16(b, pkt->v.subscribe.packet_id);
+    for (i = 0; i < pkt->v.subscribe.n; i++) {
+        mqtt_b_write_utf(b, &pkt->v.subscribe.topic_name[i]);
+        mqtt_b_write_u8(b, pkt->v.subscribe.qos[i]);
+    }
 }
 
 static int
-__serialize_publish(struct mqtt_packet *pkt, struct mqtt_b *b) {
+__length_unsubscribe(struct mqtt_packet *pkt) {
     int r_l;
-    int l_len;
-    char l[4];
-    uint8_t h;
     int i;
 
-    h = 0x30;
-    if (pkt->h.dup)
-        h |= (1 << 3);
-    h |= (pkt->h.qos << 1);
-    if (pkt->h.retain)
-        h |= (1 << 0);
-    r_l = 2 + pkt->v.publish.topic_name.n + pkt->payload.n;
-    if (pkt->h.qos > MQTT_QOS_0)
-        r_l += 2;
-    l_len = __pack_remain_length(r_l, l);
-    b->n = l_len + r_l + 1;
-    b->s = malloc(b->n);
-    if (!b->s) return -1;
-    b->n = 0;
-    mqtt_b_write_u8(b, h);
-    for (i = 0; i < l_len; i++)
-        mqtt_b_write_u8(b, l[i]);
+    r_l = 2;
+    for (i = 0; i < pkt->v.unsubscribe.n; i++)
+        r_l += 2 + pkt->v.unsubscribe.topic_name[i].n;
+    return r_l;
+}
+
+static void
+__serialize_unsubscribe(struct mqtt_packet *pkt, struct mqtt_b *b) {
+    int i;
+
+    mqtt_b_write_u16(b, pkt->v.unsubscribe.packet_id);
+    for (i = 0; i < pkt->v.unsubscribe.n; i++)
+        mqtt_b_write_utf(b, &pkt->v.unsubscribe.topic_name[i]);
+}
+#endif
+
+#ifdef MQTT_ROLE_BROKER
+static void
+__serialize_suback(struct mqtt_packet *pkt, struct mqtt_b *b) {
+    int i;
+
+    mqtt_b_write_u16(b, pkt->v.suback.packet_id);
+    for (i = 0; i < pkt->v.suback.n; i++)
+        mqtt_b_write_u8(b, pkt->v.suback.qos[i]);
+}
+#endif
+
+static void
+__serialize_publish_head(struct mqtt_packet *pkt, struct mqtt_b *b) {
     mqtt_b_write_utf(b, &pkt->v.publish.topic_name);
     if (pkt->h.qos > MQTT_QOS_0)
         mqtt_b_write_u16(b, pkt->v.publish.packet_id);
-    memcpy(&b->s[b->n], pkt->payload.s, pkt->payload.n);
-    b->n += pkt->payload.n;
-    return 0;
 }
 
-static int
-__serialize_puback(struct mqtt_packet *pkt, struct mqtt_b *b) {
-    b->s = malloc(4);
-    if (!b->s) return -1;
-    b->n = 0;
-    mqtt_b_write_u8(b, 0x40);
-    mqtt_b_write_u8(b, 0x02);
-    mqtt_b_write_u16(b, pkt->v.puback.packet_id);
-    return 0;
+static void
+__serialize_publish(struct mqtt_packet *pkt, struct mqtt_b *b) {
+    __serialize_publish_head(pkt, b);
+    if (pkt->payload.n > 0) {
+        memcpy(&b->s[b->n], pkt->payload.s, pkt->payload.n);
+        b->n += pkt->payload.n;
+    }
 }
 
+/* first byte of the fixed header and the remaining length, -1 if this
+ * codec role does not send the packet type. */
 static int
-__serialize_pubrec(struct mqtt_packet *pkt, struct mqtt_b *b) {
-    b->s = malloc(4);
-    if (!b->s) return -1;
-    b->n = 0;
-    mqtt_b_write_u8(b, 0x50);
-    mqtt_b_write_u8(b, 0x02);
-    mqtt_b_write_u16(b, pkt->v.pubrec.packet_id);
-    return 0;
+__fixed_header(struct mqtt_packet *pkt, uint8_t *h) {
+    switch (pkt->h.type) {
+#ifdef MQTT_ROLE_CLIENT
+    case CONNECT:
+        *h = 0x10;
+        return __length_connect(pkt);
+#endif
+#ifdef MQTT_ROLE_BROKER
+    case CONNACK:
+        *h = 0x20;
+        return 2;
+#endif
+    case PUBLISH:
+        *h = 0x30 | (pkt->h.dup << 3) | ((pkt->h.qos & 0x03) << 1) | (pkt->h.retain & 0x01);
+        return 2 + pkt->v.publish.topic_name.n + pkt->payload.n + (pkt->h.qos > MQTT_QOS_0 ? 2 : 0);
+    case PUBACK:
+        *h = 0x40;
+        return 2;
+    case PUBREC:
+        *h = 0x50;
+        return 2;
+    case PUBREL:
+        *h = 0x62;
+        return 2;
+    case PUBCOMP:
+        *h = 0x70;
+        return 2;
+#ifdef MQTT_ROLE_CLIENT
+    case SUBSCRIBE:
+        *h = 0x82;
+        return __length_subscribe(pkt);
+#endif
+#ifdef MQTT_ROLE_BROKER
+    case SUBACK:
+        *h = 0x90;
+        return 2 + pkt->v.suback.n;
+#endif
+#ifdef MQTT_ROLE_CLIENT
+    case UNSUBSCRIBE:
+        *h = 0xa2;
+        return __length_unsubscribe(pkt);
+#endif
+#ifdef MQTT_ROLE_BROKER
+    case UNSUBACK:
+        *h = 0xb0;
+        return 2;
+#endif
+#ifdef MQTT_ROLE_CLIENT
+    case PINGREQ:
+        *h = 0xc0;
+        return 0;
+#endif
+#ifdef MQTT_ROLE_BROKER
+    case PINGRESP:
+        *h = 0xd0;
+        return 0;
+#endif
+#ifdef MQTT_ROLE_CLIENT
+    case DISCONNECT:
+        *h = 0xe0;
+        return 0;
+#endif
+    default:
+        return -1;
+    }
 }
 
-static int
-__serialize_pubrel(struct mqtt_packet *pkt, struct mqtt_b *b) {
-    b->s = malloc(4);
-    if (!b->s) return -1;
-    b->n = 0;
-    mqtt_b_write_u8(b, 0x62);
-    mqtt_b_write_u8(b, 0x02);
-    mqtt_b_write_u16(b, pkt->v.pubrel.packet_id);
-    return 0;
-}
+int
+mqtt__packet_size(struct mqtt_packet *pkt) {
+    uint8_t h;
+    int r_l;
 
-static int
-__serialize_pubcomp(struct mqtt_packet *pkt, struct mqtt_b *b) {
-    b->s = malloc(4);
-    if (!b->s) return -1;
-    b->n = 0;
-    mqtt_b_write_u8(b, 0x70);
-    mqtt_b_write_u8(b, 0x02);
-    mqtt_b_write_u16(b, pkt->v.pubcomp.packet_id);
-    return 0;
+    r_l = __fixed_header(pkt, &h);
+    if (r_l < 0 || r_l > MQTT_MAX_LENGTH)
+        return -1;
+    return 1 + 1 + (r_l >= 0x80) + (r_l >= 0x4000) + (r_l >= 0x200000) + r_l;
 }
 
-static int
-__serialize_subscribe(struct mqtt_packet *pkt, struct mqtt_b *b) {
+int
+mqtt__serialize_into(struct mqtt_packet *pkt, char *buf, int cap) {
+    struct mqtt_b b;
+    uint8_t h;
     int r_l;
-    int l_len;
     char l[4];
+    int l_len;
     int i;
 
-    r_l = 2;
-    for (i = 0; i < pkt->v.subscribe.n; i++)
-        r_l += 2 + pkt->v.subscribe.topic_name[i].n + 1;
+    r_l = __fixed_header(pkt, &h);
+    if (r_l < 0 || r_l > MQTT_MAX_LENGTH)
+        return -1;
     l_len = __pack_remain_length(r_l, l);
-    b->n = l_len + r_l + 1;
-    b->s = malloc(b->n);
-    if (!b->s) return -1;
-    b->n = 0;
-    mqtt_b_write_u8(b, 0x82);
+    if (1 + l_len + r_l > cap)
+        return -1;
+    b.s = buf;
+    b.n = 0;
+    mqtt_b_write_u8(&b, h);
     for (i = 0; i < l_len; i++)
-        mqtt_b_write_u8(b, l[i]);
-    mqtt_b_write_u16(b, pkt->v.subscribe.packet_id);
-    for (i = 0; i < pkt->v.subscribe.n; i++) {
-        mqtt_b_write_utf(b, &pkt->v.subscribe.topic_name[i]);
-        mqtt_b_write_u8(b, pkt->v.subscribe.qos[i]);
+        mqtt_b_write_u8(&b, l[i]);
+    switch (pkt->h.type) {
+#ifdef MQTT_ROLE_CLIENT
+    case CONNECT:
+        __serialize_connect(pkt, &b);
+        break;
+#endif
+#ifdef MQTT_ROLE_BROKER
+    case CONNACK:
+        mqtt_b_write_u8(&b, (uint8_t)pkt->v.connack.ack_flags);
+        mqtt_b_write_u8(&b, (uint8_t)pkt->v.connack.return_code);
+        break;
+#endif
+    case PUBLISH:
+        __serialize_publish(pkt, &b);
+        break;
+    case PUBACK:
+        mqtt_b_write_u16(&b, pkt->v.puback.packet_id);
+        break;
+    case PUBREC:
+        mqtt_b_write_u16(&b, pkt->v.pubrec.packet_id);
+        break;
+    case PUBREL:
+        mqtt_b_write_u16(&b, pkt->v.pubrel.packet_id);
+        break;
+    case PUBCOMP:
+        mqtt_b_write_u16(&b, pkt->v.pubcomp.packet_id);
+        break;
+#ifdef MQTT_ROLE_CLIENT
+    case SUBSCRIBE:
+        __serialize_subscribe(pkt, &b);
+        break;
+#endif
+#ifdef MQTT_ROLE_BROKER
+    case SUBACK:
+        __serialize_suback(pkt, &b);
+        break;
+#endif
+#ifdef MQTT_ROLE_CLIENT
+    case UNSUBSCRIBE:
+        __serialize_unsubscribe(pkt, &b);
+        break;
+#endif
+#ifdef MQTT_ROLE_BROKER
+    case UNSUBACK:
+        mqtt_b_write_u16(&b, pkt->v.unsuback.packet_id);
+        break;
+#endif
+    default:
+        break;
     }
-    return 0;
+    return b.n;
 }
 
-static int
-__serialize_suback(struct mqtt_packet *pkt, struct mqtt_b *b) {
+/* PUBLISH is split into a header written to `head` and the payload
+ * referenced in place, other packets are written whole to `head`.
+ * returns the number of iovecs used. */
+int
+mqtt__serialize_iov(struct mqtt_packet *pkt, char *head, int cap, struct iovec iov[2]) {
+    struct mqtt_b b;
+    uint8_t h;
     int r_l;
-    int l_len;
     char l[4];
+    int l_len;
     int i;
 
-    r_l = pkt->v.suback.n + 2;
+    if (pkt->h.type != PUBLISH) {
+        r_l = mqtt__serialize_into(pkt, head, cap);
+        if (r_l < 0)
+            return -1;
+        iov[0].iov_base = head;
+        iov[0].iov_len = r_l;
+        return 1;
+    }
+    r_l = __fixed_header(pkt, &h);
+    if (r_l < 0 || r_l > MQTT_MAX_LENGTH)
+        return -1;
     l_len = __pack_remain_length(r_l, l);
-    b->n = l_len + r_l + 1;
-    b->s = malloc(b->n);
-    if (!b->s) return -1;
-    b->n = 0;
-    mqtt_b_write_u8(b, 0x90);
+    if (1 + l_len + r_l - pkt->payload.n > cap)
+        return -1;
+    b.s = head;
+    b.n = 0;
+    mqtt_b_write_u8(&b, h);
     for (i = 0; i < l_len; i++)
-        mqtt_b_write_u8(b, l[i]);
-    mqtt_b_write_u16(b, pkt->v.suback.packet_id);
-    for (i = 0; i < pkt->v.suback.n; i++)
-        mqtt_b_write_u8(b, pkt->v.suback.qos[i]);
-    return 0;
+        mqtt_b_write_u8(&b, l[i]);
+    __serialize_publish_head(pkt, &b);
+    iov[0].iov_base = head;
+    iov[0].iov_len = b.n;
+    if (pkt->payload.n <= 0)
+        return 1;
+    iov[1].iov_base = pkt->payload.s;
+    iov[1].iov_len = pkt->payload.n;
+    return 2;
 }
 
-static int
-__serialize_unsubscribe(struct mqtt_packet *pkt, struct mqtt_b *b) {
-    int r_l;
-    int l_len;
-    char l[4];
-    int i;
+int
+mqtt__serialize(struct mqtt_packet *pkt, struct mqtt_b *b) {
+    int size;
 
-    r_l = 2;
-    for (i = 0; i < pkt->v.unsubscribe.n; i++)
-        r_l += 2 + pkt->v.unsubscribe.topic_name[i].n;
-    l_len = __pack_remain_length(r_l, l);
-    b->n = l_len + r_l + 1;
-    b->s = malloc(b->n);
-    if (!b->s) return -1;
     b->n = 0;
-    mqtt_b_write_u8(b, 0xa2);
-    for (i = 0; i < l_len; i++)
-        mqtt_b_write_u8(b, l[i]);
-    mqtt_b_write_u16(b, pkt->v.unsubscribe.packet_id);
-    for (i = 0; i < pkt->v.unsubscribe.n; i++) {
-        mqtt_b_write_utf(b, &pkt->v.unsubscribe.topic_name[i]);
-    }
+    b->s = 0;
+    size = mqtt__packet_size(pkt);
+    if (size < 0)
+        return -1;
+    b->s = malloc(size);
+    if (!b->s)
+        return -1;
+    b->n = mqtt__serialize_into(pkt, b->s, size);
     return 0;
 }
 
-static int
-__serialize_unsuback(struct mqtt_packet *pkt, struct mqtt_b *b) {
-    b->s = malloc(4);
-    if (!b->s) return -1;
+void
+mqtt__batch_init(struct mqtt_batch *b) {
+    memset(b, 0, sizeof *b);
+}
+
+void
+mqtt__batch_free(struct mqtt_batch *b) {
+    free(b->s);
+    memset(b, 0, sizeof *b);
+}
+
+void
+mqtt__batch_reset(struct mqtt_batch *b) {
     b->n = 0;
-    mqtt_b_write_u8(b, 0xb0);
-    mqtt_b_write_u8(b, 0x02);
-    mqtt_b_write_u16(b, pkt->v.unsuback.packet_id);
-    return 0;
+    b->count = 0;
 }
 
 static int
-__serialize_pingreq(struct mqtt_packet *pkt, struct mqtt_b *b) {
-    b->s = malloc(2);
-    if (!b->s) return -1;
-    b->n = 0;
-    mqtt_b_write_u8(b, 0xc0);
-    mqtt_b_write_u8(b, 0x00);
+__batch_reserve(struct mqtt_batch *b, int n) {
+    char *s;
+    int size;
+
+    if (b->n + n <= b->size)
+        return 0;
+    size = b->size ? b->size : 256;
+    while (size < b->n + n)
+        size *= 2;
+    s = realloc(b->s, size);
+    if (!s)
+        return -1;
+    b->s = s;
+    b->size = size;
     return 0;
 }
 
-static int
-__serialize_pingresp(struct mqtt_packet *pkt, struct mqtt_b *b) {
-    b->s = malloc(2);
-    if (!b->s) return -1;
-    b->n = 0;
-    mqtt_b_write_u8(b, 0xd0);
-    mqtt_b_write_u8(b, 0x00);
+int
+mqtt__batch_append(struct mqtt_batch *b, struct mqtt_packet *pkt) {
+    int size;
+
+    size = mqtt__packet_size(pkt);
+    if (size < 0 || __batch_reserve(b, size))
+        return -1;
+    b->n += mqtt__serialize_into(pkt, b->s + b->n, size);
+    b->count++;
     return 0;
 }
 
-static int
-__serialize_disconnect(struct mqtt_packet *pkt, struct mqtt_b *b) {
-    b->s = malloc(2);
-    if (!b->s) return -1;
-    b->n = 0;
-    mqtt_b_write_u8(b, 0xe0);
-    mqtt_b_write_u8(b, 0x00);
+/* append bytes already encoded, e.g. MQTT_PUBACK or an iovec. */
+int
+mqtt__batch_write(struct mqtt_batch *b, const char *s, int n) {
+    if (__batch_reserve(b, n))
+        return -1;
+    memcpy(b->s + b->n, s, n);
+    b->n += n;
     return 0;
 }
 
 int
-mqtt__serialize(struct mqtt_packet *pkt, struct mqtt_b *b) {
-    b->n = 0;
-    b->s = 0;
-    switch (pkt->h.type) {
-    case CONNECT:
-        return __serialize_connect(pkt, b);
-    case CONNACK:
-        return __serialize_connack(pkt, b);
-    case PUBLISH:
-        return __serialize_publish(pkt, b);
-    case PUBACK:
-        return __serialize_puback(pkt, b);
-    case PUBREC:
-        return __serialize_pubrec(pkt, b);
-    case PUBREL:
-        return __serialize_pubrel(pkt, b);
-    case PUBCOMP:
-        return __serialize_pubcomp(pkt, b);
-    case SUBSCRIBE:
-        return __serialize_subscribe(pkt, b);
-    case SUBACK:
-        return __serialize_suback(pkt, b);
-    case UNSUBSCRIBE:
-        return __serialize_unsubscribe(pkt, b);
-    case UNSUBACK:
-        return __serialize_unsuback(pkt, b);
-    case PINGREQ:
-        return __serialize_pingreq(pkt, b);
-    case PINGRESP:
-        return __serialize_pingresp(pkt, b);
-    case DISCONNECT:
-        return __serialize_disconnect(pkt, b);
-    default:
+mqtt__template_init(struct mqtt_p_template *t, struct mqtt_b *topic, enum mqtt_qos qos, int retain) {
+    struct mqtt_b b;
+
+    if (topic->n > 0xffff || !MQTT_IS_QOS(qos))
+        return -1;
+    t->s = malloc(5 + 2 + topic->n + 2);
+    if (!t->s)
         return -1;
+    b.s = t->s;
+    b.n = 5;
+    mqtt_b_write_utf(&b, topic);
+    t->n = b.n;
+    if (qos > MQTT_QOS_0)
+        t->n += 2;
+    t->h = 0x30 | ((qos & 0x03) << 1) | (retain ? 1 : 0);
+    t->qos = qos;
+    return 0;
+}
+
+void
+mqtt__template_free(struct mqtt_p_template *t) {
+    free(t->s);
+    t->s = 0;
+    t->n = 0;
+}
+
+/* patch the remaining length and packet id into the cached header. */
+int
+mqtt__template_iov(struct mqtt_p_template *t, uint16_t packet_id, struct mqtt_b *payload, struct iovec iov[2]) {
+    char l[4];
+    int r_l, l_len;
+    char *s;
+
+    r_l = t->n - 5 + payload->n;
+    if (r_l > MQTT_MAX_LENGTH)
+        return -1;
+    if (t->qos > MQTT_QOS_0) {
+        t->s[t->n - 2] = (packet_id & 0xff00) >> 8;
+        t->s[t->n - 1] = packet_id & 0x00ff;
     }
+    l_len = __pack_remain_length(r_l, l);
+    s = t->s + 4 - l_len;
+    s[0] = t->h;
+    memcpy(s + 1, l, l_len);
+    iov[0].iov_base = s;
+    iov[0].iov_len = t->n - 4 + l_len;
+    if (payload->n <= 0)
+        return 1;
+    iov[1].iov_base = payload->s;
+    iov[1].iov_len = payload->n;
+    return 2;
 }
 
 #endif // MQTT_IMPLEMENTATION